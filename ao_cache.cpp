@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <cmath>
+#include "ao_cache.h"
+
+
+ao_cache::ao_cache(float maxError, float minRadius, float maxRadius, size_t stripeCount)
+        : mMaxError(maxError), mMinRadius(minRadius), mMaxRadius(maxRadius),
+          mCellSize(maxError * maxRadius), mRecordCount(0) {
+    if (stripeCount == 0) {
+        stripeCount = 1;
+    }
+    for (size_t i = 0; i < stripeCount; i++) {
+        mStripes.push_back(std::unique_ptr<Stripe>(new Stripe()));
+    }
+}
+
+bool
+ao_cache::lookup(
+        const glm::vec3 &point,
+        const glm::vec3 &norm,
+        float &outOcclusion
+) {
+    glm::ivec3 center = cellOf(point);
+    float weightSum = 0.0f;
+    float occlusionSum = 0.0f;
+    for (int dz = -1; dz <= 1; dz++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                uint64_t key = cellKey(center + glm::ivec3(dx, dy, dz));
+                Stripe &stripe = stripeOf(key);
+                std::lock_guard<std::mutex> lock(stripe.mutex);
+                auto cell = stripe.cells.find(key);
+                if (cell == stripe.cells.end()) {
+                    continue;
+                }
+
+                for (const Record &record : cell->second) {
+                    glm::vec3 toPoint = point - record.point;
+                    /* the record lies in front of the point, its occluders may not occlude the point */
+                    if (glm::dot(toPoint, norm + record.norm) < -0.1f * record.radius) {
+                        continue;
+                    }
+
+                    float error = glm::length(toPoint) / record.radius
+                                  + sqrtf(std::max(0.0f, 1.0f - glm::dot(norm, record.norm)));
+                    if (error >= mMaxError) {
+                        continue;
+                    }
+
+                    float weight = 1.0f / std::max(error, 1e-6f);
+                    weightSum += weight;
+                    occlusionSum += weight * record.occlusion;
+                }
+            }
+        }
+    }
+
+    if (weightSum <= 0.0f) {
+        return false;
+    }
+    outOcclusion = occlusionSum / weightSum;
+    return true;
+}
+
+void
+ao_cache::insert(
+        const glm::vec3 &point,
+        const glm::vec3 &norm,
+        float occlusion,
+        float radius
+) {
+    Record record;
+    record.point = point;
+    record.norm = norm;
+    record.occlusion = occlusion;
+    record.radius = std::min(std::max(radius, mMinRadius), mMaxRadius);
+
+    uint64_t key = cellKey(cellOf(point));
+    Stripe &stripe = stripeOf(key);
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    stripe.cells[key].push_back(record);
+    mRecordCount++;
+}
+
+void
+ao_cache::clear() {
+    for (auto &stripe : mStripes) {
+        std::lock_guard<std::mutex> lock(stripe->mutex);
+        stripe->cells.clear();
+    }
+    mRecordCount = 0;
+}
+
+glm::ivec3
+ao_cache::cellOf(
+        const glm::vec3 &point
+) const {
+    return glm::ivec3(
+            (int) floorf(point.x / mCellSize),
+            (int) floorf(point.y / mCellSize),
+            (int) floorf(point.z / mCellSize)
+    );
+}
+
+uint64_t
+ao_cache::cellKey(
+        const glm::ivec3 &cell
+) {
+    /* 21 bits per axis, cells further than 2^20 from the origin wrap around and only share a bucket */
+    const uint64_t mask = (1u << 21) - 1;
+    return ((uint64_t) cell.x & mask)
+           | (((uint64_t) cell.y & mask) << 21)
+           | (((uint64_t) cell.z & mask) << 42);
+}
+
+ao_cache::Stripe &
+ao_cache::stripeOf(
+        uint64_t key
+) {
+    uint64_t hash = key * 0x9e3779b97f4a7c15ull;
+    return *mStripes[(hash >> 32) % mStripes.size()];
+}
@@ -0,0 +1,74 @@
+#ifndef RAY_TRACING_AO_CACHE_H
+#define RAY_TRACING_AO_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+
+
+/**
+  World-space cache of ambient occlusion samples for static geometry, in the manner of Ward's irradiance cache.
+  Records live in a hash grid of cells of maxError * maxRadius, so every record that may be valid at a point
+  is in the 3x3x3 cells around it. Cells are spread over stripes with a mutex each, threads only contend when
+  they touch cells of the same stripe at the same time.
+*/
+class ao_cache {
+private:
+    typedef struct _Record {
+        glm::vec3 point;
+        glm::vec3 norm;
+        float occlusion;
+        /* harmonic mean distance to the occluders, how far the record can be reused */
+        float radius;
+    } Record;
+
+    typedef struct _Stripe {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, std::vector<Record>> cells;
+    } Stripe;
+
+    float mMaxError;
+    float mMinRadius;
+    float mMaxRadius;
+    float mCellSize;
+    std::vector<std::unique_ptr<Stripe>> mStripes;
+    std::atomic<size_t> mRecordCount;
+
+    ao_cache(const ao_cache &cache) = delete;
+
+    ao_cache &operator=(const ao_cache &cache) = delete;
+
+    glm::ivec3 cellOf(const glm::vec3 &point) const;
+
+    static uint64_t cellKey(const glm::ivec3 &cell);
+
+    Stripe &stripeOf(uint64_t key);
+
+public:
+    ao_cache(float maxError, float minRadius, float maxRadius, size_t stripeCount);
+
+    /**
+      Interpolates the records valid at point with the normal norm, weighted by their error estimate.
+      Returns false if there is none, then the caller has to sample the occlusion and insert it
+    */
+    bool lookup(const glm::vec3 &point, const glm::vec3 &norm, float &outOcclusion);
+
+    /**
+      radius is clamped to [minRadius, maxRadius] so that records in open space and in tight corners
+      are neither reused everywhere nor never
+    */
+    void insert(const glm::vec3 &point, const glm::vec3 &norm, float occlusion, float radius);
+
+    void clear();
+
+    size_t size() const {
+        return mRecordCount;
+    }
+};
+
+
+#endif //RAY_TRACING_AO_CACHE_H
@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <utility>
+#include "bvh.h"
+
+
+typedef struct _BvhBuildPrim {
+    glm::vec3 bboxMin;
+    glm::vec3 bboxMax;
+    glm::vec3 centroid;
+    uint32_t id;
+} BvhBuildPrim;
+
+
+typedef struct _BvhBin {
+    glm::vec3 bboxMin;
+    glm::vec3 bboxMax;
+    uint32_t count;
+
+    _BvhBin() : bboxMin(INFINITY), bboxMax(-INFINITY), count(0) {}
+} BvhBin;
+
+
+static float
+surfaceArea(
+        const glm::vec3 &bboxMin,
+        const glm::vec3 &bboxMax
+) {
+    glm::vec3 d = bboxMax - bboxMin;
+    if (d.x < 0.0f || d.y < 0.0f || d.z < 0.0f) {
+        return 0.0f;
+    }
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+
+static int
+binIndex(
+        float centroid,
+        float centroidMin,
+        float binScale
+) {
+    int bin = static_cast<int>((centroid - centroidMin) * binScale);
+    return std::min(std::max(bin, 0), BVH_BIN_COUNT - 1);
+}
+
+
+/**
+  Partitions [begin, end) at the cheapest binned SAH split and returns the first primitive of the right child,
+  begin if the primitives are better left in a leaf
+*/
+static std::vector<BvhBuildPrim>::iterator
+splitSah(
+        std::vector<BvhBuildPrim>::iterator begin,
+        std::vector<BvhBuildPrim>::iterator end,
+        uint32_t count,
+        const glm::vec3 &bboxMin,
+        const glm::vec3 &bboxMax,
+        const glm::vec3 &centroidMin,
+        const glm::vec3 &centroidMax
+) {
+    /* binned SAH: split cost is measured in primitive tests, traversal step costs one test */
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float bestCost = INFINITY;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroidMax[axis] - centroidMin[axis];
+        if (extent < EPS) {
+            continue;
+        }
+        float binScale = BVH_BIN_COUNT / extent;
+
+        BvhBin bins[BVH_BIN_COUNT];
+        for (auto it = begin; it != end; it++) {
+            BvhBin &bin = bins[binIndex(it->centroid[axis], centroidMin[axis], binScale)];
+            bin.bboxMin = glm::min(bin.bboxMin, it->bboxMin);
+            bin.bboxMax = glm::max(bin.bboxMax, it->bboxMax);
+            bin.count++;
+        }
+
+        float leftArea[BVH_BIN_COUNT - 1];
+        uint32_t leftCount[BVH_BIN_COUNT - 1];
+        glm::vec3 accMin(INFINITY);
+        glm::vec3 accMax(-INFINITY);
+        uint32_t accCount = 0;
+        for (int i = 0; i < BVH_BIN_COUNT - 1; i++) {
+            accMin = glm::min(accMin, bins[i].bboxMin);
+            accMax = glm::max(accMax, bins[i].bboxMax);
+            accCount += bins[i].count;
+            leftArea[i] = surfaceArea(accMin, accMax);
+            leftCount[i] = accCount;
+        }
+
+        accMin = glm::vec3(INFINITY);
+        accMax = glm::vec3(-INFINITY);
+        accCount = 0;
+        for (int i = BVH_BIN_COUNT - 1; i > 0; i--) {
+            accMin = glm::min(accMin, bins[i].bboxMin);
+            accMax = glm::max(accMax, bins[i].bboxMax);
+            accCount += bins[i].count;
+            if (accCount == 0 || leftCount[i - 1] == 0) {
+                continue;
+            }
+            float cost = leftArea[i - 1] * leftCount[i - 1] + surfaceArea(accMin, accMax) * accCount;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+
+    if (bestAxis < 0) {
+        /* all centroids coincide, nothing to split */
+        return begin;
+    }
+
+    float nodeArea = surfaceArea(bboxMin, bboxMax);
+    float splitCost = 1.0f + (nodeArea > 0.0f ? bestCost / nodeArea : 0.0f);
+    if (count <= BVH_MAX_LEAF_SIZE && splitCost >= static_cast<float>(count)) {
+        return begin;
+    }
+
+    float axisMin = centroidMin[bestAxis];
+    float binScale = BVH_BIN_COUNT / (centroidMax[bestAxis] - axisMin);
+    return std::partition(begin, end, [&](const BvhBuildPrim &prim) {
+        return binIndex(prim.centroid[bestAxis], axisMin, binScale) < bestSplit;
+    });
+}
+
+
+void
+buildBvh(
+        Scene &scene
+) {
+    scene.bvhNodes.clear();
+    scene.bvhPrimIds.clear();
+
+    std::vector<BvhBuildPrim> prims;
+    prims.reserve(scene.triangles.size() + scene.spheres.size());
+    for (size_t i = 0; i < scene.triangles.size(); i++) {
+        const glm::vec3 &p = scene.triangles.points[i];
+        glm::vec3 p1 = p + scene.triangles.edges1[i];
+        glm::vec3 p2 = p + scene.triangles.edges2[i];
+        BvhBuildPrim prim;
+        prim.bboxMin = glm::min(p, glm::min(p1, p2));
+        prim.bboxMax = glm::max(p, glm::max(p1, p2));
+        prim.centroid = (prim.bboxMin + prim.bboxMax) * 0.5f;
+        prim.id = (uint32_t) i;
+        prims.push_back(prim);
+    }
+    for (size_t i = 0; i < scene.spheres.size(); i++) {
+        const glm::vec3 &center = scene.spheres.centers[i];
+        float radius = scene.spheres.radii[i];
+        BvhBuildPrim prim;
+        prim.bboxMin = center - glm::vec3(radius);
+        prim.bboxMax = center + glm::vec3(radius);
+        prim.centroid = center;
+        prim.id = (uint32_t) (scene.triangles.size() + i);
+        prims.push_back(prim);
+    }
+
+    if (prims.empty()) {
+        return;
+    }
+
+    /* every node is split in two, so there are at most 2N - 1 nodes */
+    scene.bvhNodes.reserve(prims.size() * 2);
+    scene.bvhNodes.push_back(BvhNode());
+    scene.bvhNodes[0].leftFirst = 0;
+    scene.bvhNodes[0].primCount = (uint32_t) prims.size();
+
+    /*
+      Traversal keeps at most one pending sibling per level plus the two children of the current node,
+      so leaves may be at most BVH_STACK_SIZE - 1 levels deep. A node holding at most 2^r primitives
+      with r levels left below it can always reach single primitive leaves by median splits,
+      SAH splits are only used while every possible child still fits that bound
+    */
+    std::vector<std::pair<uint32_t, int>> stack;
+    stack.push_back(std::make_pair(0u, 0));
+    while (!stack.empty()) {
+        uint32_t nodeIdx = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+
+        uint32_t first = scene.bvhNodes[nodeIdx].leftFirst;
+        uint32_t count = scene.bvhNodes[nodeIdx].primCount;
+        auto begin = prims.begin() + first;
+        auto end = begin + count;
+
+        glm::vec3 bboxMin(INFINITY);
+        glm::vec3 bboxMax(-INFINITY);
+        glm::vec3 centroidMin(INFINITY);
+        glm::vec3 centroidMax(-INFINITY);
+        for (auto it = begin; it != end; it++) {
+            bboxMin = glm::min(bboxMin, it->bboxMin);
+            bboxMax = glm::max(bboxMax, it->bboxMax);
+            centroidMin = glm::min(centroidMin, it->centroid);
+            centroidMax = glm::max(centroidMax, it->centroid);
+        }
+        scene.bvhNodes[nodeIdx].bboxMin = bboxMin;
+        scene.bvhNodes[nodeIdx].bboxMax = bboxMax;
+
+        int levelsLeft = BVH_STACK_SIZE - 1 - depth;
+        if (count == 1 || levelsLeft <= 0) {
+            continue;
+        }
+
+        auto middle = begin;
+        if (levelsLeft - 1 < 32 && count > (1u << (levelsLeft - 1))) {
+            /* too deep for SAH, split at the median of the widest centroid extent */
+            glm::vec3 extent = centroidMax - centroidMin;
+            int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+            middle = begin + count / 2;
+            std::nth_element(begin, middle, end, [axis](const BvhBuildPrim &a, const BvhBuildPrim &b) {
+                return a.centroid[axis] < b.centroid[axis];
+            });
+        } else {
+            middle = splitSah(begin, end, count, bboxMin, bboxMax, centroidMin, centroidMax);
+        }
+        uint32_t leftCountTotal = (uint32_t) (middle - begin);
+        if (leftCountTotal == 0 || leftCountTotal == count) {
+            continue;
+        }
+
+        uint32_t leftIdx = (uint32_t) scene.bvhNodes.size();
+        scene.bvhNodes.push_back(BvhNode());
+        scene.bvhNodes.push_back(BvhNode());
+        scene.bvhNodes[leftIdx].leftFirst = first;
+        scene.bvhNodes[leftIdx].primCount = leftCountTotal;
+        scene.bvhNodes[leftIdx + 1].leftFirst = first + leftCountTotal;
+        scene.bvhNodes[leftIdx + 1].primCount = count - leftCountTotal;
+        scene.bvhNodes[nodeIdx].leftFirst = leftIdx;
+        scene.bvhNodes[nodeIdx].primCount = 0;
+
+        stack.push_back(std::make_pair(leftIdx + 1, depth + 1));
+        stack.push_back(std::make_pair(leftIdx, depth + 1));
+    }
+
+    scene.bvhPrimIds.reserve(prims.size());
+    for (auto &prim : prims) {
+        scene.bvhPrimIds.push_back(prim.id);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef RAY_TRACING_BVH_H
+#define RAY_TRACING_BVH_H
+
+#include <cmath>
+#include "scene.h"
+
+
+void
+buildBvh(
+        Scene &scene
+);
+
+
+/**
+  Reciprocal of the ray direction with zero components replaced by a huge finite value, so that the slab test
+  never evaluates 0 * inf when the ray origin lies on a box face.
+*/
+inline glm::vec3
+inverseRayDir(
+        const glm::vec3 &rayDir
+) {
+    return glm::vec3(
+            1.0f / (fabsf(rayDir.x) > 1e-20f ? rayDir.x : copysignf(1e-20f, rayDir.x)),
+            1.0f / (fabsf(rayDir.y) > 1e-20f ? rayDir.y : copysignf(1e-20f, rayDir.y)),
+            1.0f / (fabsf(rayDir.z) > 1e-20f ? rayDir.z : copysignf(1e-20f, rayDir.z))
+    );
+}
+
+
+/**
+  Slab test. Returns the distance to the box entry point or INFINITY if the ray misses the box
+  or enters it farther than tMax.
+*/
+inline float
+intersectBvhNode(
+        const BvhNode &node,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayInvDir,
+        float tMax
+) {
+    glm::vec3 t1 = (node.bboxMin - rayFrom) * rayInvDir;
+    glm::vec3 t2 = (node.bboxMax - rayFrom) * rayInvDir;
+    glm::vec3 tMin = glm::min(t1, t2);
+    glm::vec3 tFar = glm::max(t1, t2);
+    float tEnter = std::max(std::max(tMin.x, tMin.y), tMin.z);
+    float tExit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+    if (tExit >= tEnter && tExit > 0.0f && tEnter <= tMax) {
+        return tEnter;
+    } else {
+        return INFINITY;
+    }
+}
+
+#endif //RAY_TRACING_BVH_H
@@ -0,0 +1,80 @@
+#include <cmath>
+#include "camera_input.h"
+
+
+camera_input::camera_input(GLFWwindow *window, const Scene &scene)
+        : mWindow(window), mCamPos(scene.camPos), mCamMat(scene.camMat), mLastTime(glfwGetTime()),
+          mCursorX(0.0), mCursorY(0.0), mDragging(false), mMoved(false) {}
+
+void
+camera_input::poll() {
+    double now = glfwGetTime();
+    float dt = static_cast<float>(now - mLastTime);
+    mLastTime = now;
+
+    /* camera space: x to the right, y up, the view looks along -z */
+    glm::vec3 move(0.0f);
+    if (glfwGetKey(mWindow, GLFW_KEY_W) == GLFW_PRESS) {
+        move.z -= 1.0f;
+    }
+    if (glfwGetKey(mWindow, GLFW_KEY_S) == GLFW_PRESS) {
+        move.z += 1.0f;
+    }
+    if (glfwGetKey(mWindow, GLFW_KEY_A) == GLFW_PRESS) {
+        move.x -= 1.0f;
+    }
+    if (glfwGetKey(mWindow, GLFW_KEY_D) == GLFW_PRESS) {
+        move.x += 1.0f;
+    }
+    if (glfwGetKey(mWindow, GLFW_KEY_Q) == GLFW_PRESS) {
+        move.y -= 1.0f;
+    }
+    if (glfwGetKey(mWindow, GLFW_KEY_E) == GLFW_PRESS) {
+        move.y += 1.0f;
+    }
+    if (move.x != 0.0f || move.y != 0.0f || move.z != 0.0f) {
+        /* same mapping from camera to world space as the camera rays */
+        mCamPos += (move * mCamMat) * (CAMERA_MOVE_SPEED * dt);
+        mMoved = true;
+    }
+
+    double cursorX, cursorY;
+    glfwGetCursorPos(mWindow, &cursorX, &cursorY);
+    if (glfwGetMouseButton(mWindow, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
+        if (mDragging && (cursorX != mCursorX || cursorY != mCursorY)) {
+            float yaw = static_cast<float>(mCursorX - cursorX) * CAMERA_TURN_SPEED;
+            float pitch = static_cast<float>(cursorY - mCursorY) * CAMERA_TURN_SPEED;
+            /* rotations in camera space, a ray dir d maps to (r * d) * mCamMat = d * (transpose(r) * mCamMat) */
+            glm::mat3 yawMat(
+                    cosf(yaw), 0.0f, -sinf(yaw),
+                    0.0f, 1.0f, 0.0f,
+                    sinf(yaw), 0.0f, cosf(yaw)
+            );
+            glm::mat3 pitchMat(
+                    1.0f, 0.0f, 0.0f,
+                    0.0f, cosf(pitch), sinf(pitch),
+                    0.0f, -sinf(pitch), cosf(pitch)
+            );
+            mCamMat = glm::transpose(yawMat * pitchMat) * mCamMat;
+            mMoved = true;
+        }
+        mDragging = true;
+    } else {
+        mDragging = false;
+    }
+    mCursorX = cursorX;
+    mCursorY = cursorY;
+}
+
+bool
+camera_input::apply(
+        Scene &scene
+) {
+    if (!mMoved) {
+        return false;
+    }
+    scene.camPos = mCamPos;
+    scene.camMat = mCamMat;
+    mMoved = false;
+    return true;
+}
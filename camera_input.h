@@ -0,0 +1,38 @@
+#ifndef RAY_TRACING_CAMERA_INPUT_H
+#define RAY_TRACING_CAMERA_INPUT_H
+
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include "scene.h"
+
+
+/**
+  Fly camera driven by GLFW: W/S/A/D move along the view, Q/E move down and up,
+  dragging with the left mouse button turns the view.
+  poll runs every window frame and only moves a copy of the camera, apply hands it to the scene
+  once no pass is reading it.
+*/
+class camera_input {
+private:
+    GLFWwindow *mWindow;
+    glm::vec3 mCamPos;
+    glm::mat3 mCamMat;
+    double mLastTime;
+    double mCursorX;
+    double mCursorY;
+    bool mDragging;
+    bool mMoved;
+
+public:
+    camera_input(GLFWwindow *window, const Scene &scene);
+
+    void poll();
+
+    /**
+      Copies the camera into scene and returns true if it moved since the last call
+    */
+    bool apply(Scene &scene);
+};
+
+
+#endif //RAY_TRACING_CAMERA_INPUT_H
@@ -8,196 +8,381 @@
     - vec3 p,
     - vec3 e1,
     - vec3 e2,
-    - vec3 norm
+    - vec3 cross(e1, e2), not normalized
 
-  struct HitParam
-    - float t
-    - float u
-    - float v
-    - vec3 hitPt
-    - vec3 norm
+  struct Sphere
+    - vec3 center
+    - float radius
 
   struct Ray
     - p_x
     - p_y
     - p_z
+    - tMin
     - d_x
     - d_y
     - d_z
+    - tMax
+
+  Only hits with tMin < t < tMax count, traversal skips BVH nodes entered beyond tMax.
+*/
+
+
+typedef struct {
+    float bboxMin[3];
+    unsigned int leftFirst;
+    float bboxMax[3];
+    unsigned int primCount;
+} BvhNode;
+
+typedef struct {
+    float t;
+    float u;
+    float v;
+    int primId;
+} HitRecord;
+
+typedef struct {
+    float color[3];
+    float diffusiveFactor;
+    float specularFactor;
+    float specularHardness;
+    float reflectionFactor;
+    int texOffset;
+    unsigned int texWidth;
+    unsigned int texHeight;
+    unsigned int texSize;
+} Material;
+
+
+/**
+  struct BvhNode
+    - float bboxMin[3]
+    - uint leftFirst
+    - float bboxMax[3]
+    - uint primCount
+
+  struct HitRecord
+    - float t
+    - float u
+    - float v
+    - int primId (-1 if nothing was hit)
+
+  Nearest triangle or sphere hit found by BVH traversal.
+  primIds < triangleCount address triangles, the rest address spheres shifted by triangleCount.
 */
 __kernel void
-triangleHit(
+bvhClosestHit(
     const __global float* triangles,
     const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+    const __global BvhNode* nodes,
+    const __global unsigned int* primIds,
     const __global float* raysVec,
     const unsigned int raysCount,
-    __global char* retHits,
-    __global float* retHitParams
+    __global HitRecord* retHits
 );
 
 
 /**
-  struct Sphere
-    - vec3 center
-    - float radius
-
-  struct HitParam
-    - float t
-    - vec3 hitPt
-    - vec3 norm
-
-  struct Ray
-    - p_x
-    - p_y
-    - p_z
-    - d_x
-    - d_y
-    - d_z
+  Occlusion test against the BVH: retHits[i] = 1 as soon as anything is hit in the ray's (tMin, tMax), 0 otherwise.
+  For shadow rays pointing at the lamp with unnormalized direction tMax = 1 stops the ray at the lamp.
 */
 __kernel void
-sphereHit(
-    const __global float* mSpheres,
+bvhAnyHit(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
     const unsigned int sphereCount,
+    const __global BvhNode* nodes,
+    const __global unsigned int* primIds,
     const __global float* raysVec,
     const unsigned int raysCount,
-    __global char* retHit,
-    __global float* retHitParams
+    __global char* retHits
 );
 
 
 /**
-  struct Triangle
-    - vec3 p,
-    - vec3 e1,
-    - vec3 e2,
-    - vec3 norm
+  Tests a ray against every triangle and sphere and keeps the nearest hit only.
+  Spheres are reported with primId = triangleCount + sphere index.
+*/
+__kernel void
+closestHit(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+    const __global float* raysVec,
+    const unsigned int raysCount,
+    __global HitRecord* retHits
+);
 
-  struct HitParam
-    - float t
-    - float u
-    - float v
-    - vec3 hitPt
-    - vec3 norm
 
-  struct Ray
-    - p_x
-    - p_y
-    - p_z
-    - d_x
-    - d_y
-    - d_z
+/**
+  Occlusion test against every triangle and sphere, stops at the first one hit in the ray's (tMin, tMax)
 */
 __kernel void
-triangleHit(
+anyHit(
     const __global float* triangles,
     const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
     const __global float* raysVec,
     const unsigned int raysCount,
-    __global char* retHits,
-    __global float* retHitParams
-) {
-    unsigned int id = get_global_id(0);
-    unsigned int iRay = get_global_id(1);
+    __global char* retHits
+);
 
-    if (id >= triangleCount || iRay >= raysCount) {
-        return;
-    }
 
-    float3 rayFrom = vload3(iRay * 2, raysVec);
-    float3 rayDir = vload3(iRay * 2 + 1, raysVec);
-    __global float *triangle = triangles + (id * 12);
-    float3 p = vload3(0, triangle);
-    float3 e1 = vload3(1, triangle);
-    float3 e2 = vload3(2, triangle);
-    float3 norm = vload3(3, triangle);
+/**
+  Primary rays for pixels [firstPixel, firstPixel + raysCount) of a width x height frame, pixels go row by row.
+  camX, camY, camZ are the columns of camMat, the camera looks along -z of its own space.
+  Also starts the wavefront: every ray belongs to its own pixel of the batch with weight 1.
+*/
+__kernel void
+cameraRays(
+    const float3 camPos,
+    const float3 camX,
+    const float3 camY,
+    const float3 camZ,
+    const unsigned int width,
+    const unsigned int height,
+    const unsigned int firstPixel,
+    const unsigned int raysCount,
+    __global float* retRays,
+    __global unsigned int* retPixelIds,
+    __global float* retWeights
+);
 
-    float3 q = rayFrom - p;
-    float3 cross_e2_e1;
-    float3 cross_e1_e2;
-    float3 cross_e2_q;
-    float3 cross_q_e1;
-    float4 buf_e1 = (float4)(e1, 0.0f);
-    float4 buf_e2 = (float4)(e2, 0.0f);
-    float4 buf_q = (float4)(q, 0.0f);
-    float4 buf_res;
 
-    buf_res = cross(buf_e2, buf_e1);
-    cross_e2_e1 = (float3)(buf_res.x, buf_res.y, buf_res.z);
+/**
+  struct Material
+    - float color[3]
+    - float diffusiveFactor
+    - float specularFactor
+    - float specularHardness
+    - float reflectionFactor
+    - int texOffset (byte offset of the RGBA texture in texels, -1 if not textured)
+    - uint texWidth
+    - uint texHeight
+    - uint texSize (texture size in bytes)
 
-    cross_e1_e2 = -cross_e2_e1;
+  Phong shading of the closest hits with a shadow ray per lamp, plus the ambient light from reduceOcclusion
+  with ENABLE_AO. The color times the ray weight is added to the linear color of the ray's pixel in accumPixels.
+  primMaterials holds the material index of every primId, triangleUvs 6 floats (uvStart, uvU, uvV) per triangle,
+  lamps 5 floats (pos, intensity, distance) per lamp.
+  If spawnReflections is set, retBounceFlags[i] = 1 marks rays whose material reflects,
+  retBounceRays[i] and retBounceWeights[i] then hold the reflected ray.
+*/
+__kernel void
+shadeHits(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+#ifdef ENABLE_BVH
+    const __global BvhNode* nodes,
+    const __global unsigned int* primIds,
+#endif
+    const __global Material* materials,
+    const __global unsigned int* primMaterials,
+    const __global float* triangleUvs,
+    const __global uchar* texels,
+    const __global float* lamps,
+    const unsigned int lampCount,
+    const float3 horizonColor,
+    const __global float* raysVec,
+    const __global HitRecord* hits,
+    const __global unsigned int* pixelIds,
+    const __global float* weights,
+#ifdef ENABLE_AO
+    const __global float* aoFactors,
+#endif
+    const unsigned int raysCount,
+    const unsigned int spawnReflections,
+    __global float* accumPixels,
+    __global float* retBounceRays,
+    __global float* retBounceWeights,
+    __global unsigned int* retBounceFlags
+);
 
-    buf_res = cross(buf_e2, buf_q);
-    cross_e2_q = (float3)(buf_res.x, buf_res.y, buf_res.z);
 
-    buf_res = cross(buf_q, buf_e1);
-    cross_q_e1 = (float3)(buf_res.x, buf_res.y, buf_res.z);
+/**
+  One occlusion ray per hit and sample, the work size is {raysCount, AO_RAYS_COUNT}.
+  Directions are uniform in the cube flipped to the viewer's side of the surface, as in the CPU tracer,
+  random numbers are keyed by the pixel of the frame and counted by bounce and sample.
+  retVisible[i * AO_RAYS_COUNT + sample] is 1 if the sample ray escapes, 0 if it is blocked or there is no hit.
+*/
+__kernel void
+ambientOcclusionRays(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+#ifdef ENABLE_BVH
+    const __global BvhNode* nodes,
+    const __global unsigned int* primIds,
+#endif
+    const __global float* raysVec,
+    const __global HitRecord* hits,
+    const __global unsigned int* pixelIds,
+    const unsigned int firstPixel,
+    const unsigned int bounce,
+    const unsigned int raysCount,
+    __global uchar* retVisible
+);
 
-    float det = dot(rayDir, cross_e2_e1);
-    float dett = dot(q, cross_e1_e2);
-    float detu = dot(rayDir, cross_e2_q);
-    float detv = dot(rayDir, cross_q_e1);
 
-    float t = dett / det;
-    float u = detu / det;
-    float v = detv / det;
-    float3 hitPt = rayFrom + t * rayDir;
+/**
+  Ambient light of every hit: ambientFactor times the share of AO samples that escaped
+*/
+__kernel void
+reduceOcclusion(
+    const __global uchar* visible,
+    const unsigned int raysCount,
+    const float ambientFactor,
+    __global float* retFactors
+);
 
-    char retHit = (det > 0.001f || det < -0.001f);
-    retHit = retHit && (t > 0.001f);
-    retHit = retHit && (u > 0.0f && v > 0.0f && u + v < 1.0f);
 
-    retHits[iRay * triangleCount + id] = retHit;
-    __global float* retHitParam = retHitParams + (iRay * 9 * triangleCount) + (id * 9);
-    retHitParam[0] = t;
-    retHitParam[1] = u;
-    retHitParam[2] = v;
-    retHitParam[3] = hitPt.x;
-    retHitParam[4] = hitPt.y;
-    retHitParam[5] = hitPt.z;
-    retHitParam[6] = norm.x;
-    retHitParam[7] = norm.y;
-    retHitParam[8] = norm.z;
-}
+/**
+  Exclusive prefix sum of values within every work-group, the group totals go to retGroupSums.
+  temp holds one uint per work item.
+*/
+__kernel void
+scanGroups(
+    const __global unsigned int* values,
+    const unsigned int count,
+    __global unsigned int* retOffsets,
+    __global unsigned int* retGroupSums,
+    __local unsigned int* temp
+);
 
 
 /**
-  struct Sphere
-    - vec3 center
-    - float radius
+  Turns per group prefix sums into global ones, groupOffsets is the exclusive prefix sum of the group totals
+*/
+__kernel void
+addGroupOffsets(
+    __global unsigned int* offsets,
+    const unsigned int count,
+    const __global unsigned int* groupOffsets
+);
 
-  struct HitParam
-    - float t
-    - vec3 hitPt
-    - vec3 norm
 
-  struct Ray
-    - p_x
-    - p_y
-    - p_z
-    - d_x
-    - d_y
-    - d_z
+/**
+  Moves the flagged bounce rays to offsets[i] of the next wavefront, offsets is the exclusive prefix sum of flags.
+  The size of the next wavefront goes to retCount.
 */
 __kernel void
-sphereHit(
-    const __global float* mSpheres,
-    const unsigned int sphereCount,
-    const __global float* raysVec,
+compactRays(
+    const __global unsigned int* flags,
+    const __global unsigned int* offsets,
     const unsigned int raysCount,
-    __global char* retHit,
-    __global float* retHitParams
+    const __global float* bounceRays,
+    const __global unsigned int* pixelIds,
+    const __global float* bounceWeights,
+    __global float* retRays,
+    __global unsigned int* retPixelIds,
+    __global float* retWeights,
+    __global unsigned int* retCount
+);
+
+
+/**
+  Gamma correction of the accumulated linear colors, in place
+*/
+__kernel void
+finishPixels(
+    __global float* pixels,
+    const unsigned int pixelCount
+);
+
+
+/**
+  Ray iRay of rays, see struct Ray
+*/
+void
+loadRay(
+    const __global float* rays,
+    unsigned int iRay,
+    float3* retFrom,
+    float3* retDir,
+    float* retTMin,
+    float* retTMax
 ) {
-    unsigned int id = get_global_id(0);
-    unsigned int iRay = get_global_id(1);
+    float4 fromAndMin = vload4(iRay * 2, rays);
+    float4 dirAndMax = vload4(iRay * 2 + 1, rays);
+    *retFrom = fromAndMin.xyz;
+    *retTMin = fromAndMin.w;
+    *retDir = dirAndMax.xyz;
+    *retTMax = dirAndMax.w;
+}
 
-    if (id >= sphereCount || iRay >= raysCount) {
-        return;
+
+void
+storeRay(
+    __global float* rays,
+    unsigned int iRay,
+    float3 rayFrom,
+    float3 rayDir,
+    float tMin,
+    float tMax
+) {
+    vstore4((float4)(rayFrom, tMin), iRay * 2, rays);
+    vstore4((float4)(rayDir, tMax), iRay * 2 + 1, rays);
+}
+
+
+/**
+  Returns nonzero if the ray hits the triangle at t > tMin, barycentric u, v are relative to e1, e2
+*/
+int
+intersectTriangle(
+    const __global float* triangle,
+    float3 rayFrom,
+    float3 rayDir,
+    float tMin,
+    float* retT,
+    float* retU,
+    float* retV
+) {
+    float3 p = vload3(0, triangle);
+    float3 e1 = vload3(1, triangle);
+    float3 e2 = vload3(2, triangle);
+    float3 cross_e1_e2 = vload3(3, triangle);
+
+    float det = -dot(rayDir, cross_e1_e2);
+    if (det < 0.001f && det > -0.001f) {
+        return 0;
     }
 
-    float3 rayFrom = vload3(iRay * 2, raysVec);
-    float3 rayDir = vload3(iRay * 2 + 1, raysVec);
+    float3 q = rayFrom - p;
+    float3 cross_q_d = cross(q, rayDir);
+    float t = dot(q, cross_e1_e2) / det;
+    float u = dot(e2, cross_q_d) / det;
+    float v = -dot(e1, cross_q_d) / det;
+    if (t > tMin && u > 0.0f && v > 0.0f && u + v < 1.0f) {
+        *retT = t;
+        *retU = u;
+        *retV = v;
+        return 1;
+    }
+    return 0;
+}
+
 
-    __global float* sphere = mSpheres + (id * 4);
+/**
+  Returns nonzero if the ray hits the sphere, retT is the nearest root beyond tMin
+*/
+int
+intersectSphere(
+    const __global float* sphere,
+    float3 rayFrom,
+    float3 rayDir,
+    float tMin,
+    float* retT
+) {
     float3 center = vload3(0, sphere);
     float radius = sphere[3];
 
@@ -207,41 +392,790 @@ sphereHit(
     float c = dot(v, v) - (radius * radius);
     float d = (b * b) - (4 * a * c);
 
-    float t = 0.0f;
-    retHit[iRay * sphereCount + id] = 0;
     if (d < 0.0f) {
-        return;
-    } else if (d < 0.0001f && d > -0.000f) {
-        t = -b / 2.0f * a;
-        if (t < 0.0f) {
-            return;
+        return 0;
+    } else if (d < 0.0001f) {
+        float t = -b / 2.0f * a;
+        if (t <= tMin) {
+            return 0;
         }
+        *retT = t;
+        return 1;
     } else {
         float sqrtD = sqrt(d);
         float t1 = (-b + sqrtD) / (2.0f * a);
         float t2 = (-b - sqrtD) / (2.0f * a);
-        if (t1 > 0.0001f && t2 > 0.0001f) {
-            t = t1 < t2 ? t1 : t2;
-        } else if (t1 > 0.0001f) {
-            t = t1;
-        } else if (t2 > 0.0001f) {
-            t = t2;
+        if (t1 > tMin && t2 > tMin) {
+            *retT = t1 < t2 ? t1 : t2;
+        } else if (t1 > tMin) {
+            *retT = t1;
+        } else if (t2 > tMin) {
+            *retT = t2;
         } else {
-            return;
+            return 0;
+        }
+        return 1;
+    }
+}
+
+
+/**
+  Slab test, returns the box entry distance or INFINITY if the box is missed or farther than tMax
+*/
+float
+intersectBvhNode(
+    const __global BvhNode* node,
+    float3 rayFrom,
+    float3 rayInvDir,
+    float tMax
+) {
+    float3 bboxMin = (float3)(node->bboxMin[0], node->bboxMin[1], node->bboxMin[2]);
+    float3 bboxMax = (float3)(node->bboxMax[0], node->bboxMax[1], node->bboxMax[2]);
+    float3 t1 = (bboxMin - rayFrom) * rayInvDir;
+    float3 t2 = (bboxMax - rayFrom) * rayInvDir;
+    float3 tMin = fmin(t1, t2);
+    float3 tFar = fmax(t1, t2);
+    float tEnter = fmax(fmax(tMin.x, tMin.y), tMin.z);
+    float tExit = fmin(fmin(tFar.x, tFar.y), tFar.z);
+    if (tExit >= tEnter && tExit > 0.0f && tEnter <= tMax) {
+        return tEnter;
+    }
+    return INFINITY;
+}
+
+
+float3
+inverseRayDir(
+    float3 rayDir
+) {
+    return (float3)(
+        1.0f / (fabs(rayDir.x) > 1e-20f ? rayDir.x : copysign(1e-20f, rayDir.x)),
+        1.0f / (fabs(rayDir.y) > 1e-20f ? rayDir.y : copysign(1e-20f, rayDir.y)),
+        1.0f / (fabs(rayDir.z) > 1e-20f ? rayDir.z : copysign(1e-20f, rayDir.z))
+    );
+}
+
+
+/**
+  Returns nonzero as soon as anything in the BVH is hit at tMin < t < tMax
+*/
+int
+isOccludedBvh(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const __global BvhNode* nodes,
+    const __global unsigned int* primIds,
+    float3 rayFrom,
+    float3 rayDir,
+    float tMin,
+    float tMax
+) {
+    float3 rayInvDir = inverseRayDir(rayDir);
+
+    unsigned int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const __global BvhNode* node = nodes + stack[--stackSize];
+        if (intersectBvhNode(node, rayFrom, rayInvDir, tMax) == INFINITY) {
+            continue;
+        }
+
+        if (node->primCount > 0) {
+            for (unsigned int i = node->leftFirst; i < node->leftFirst + node->primCount; i++) {
+                unsigned int primId = primIds[i];
+                float t, u, v;
+                if (primId < triangleCount) {
+                    if (intersectTriangle(triangles + (primId * 12), rayFrom, rayDir, tMin, &t, &u, &v) &&
+                        t < tMax) {
+                        return 1;
+                    }
+                } else {
+                    if (intersectSphere(spheres + ((primId - triangleCount) * 4), rayFrom, rayDir, tMin, &t) &&
+                        t < tMax) {
+                        return 1;
+                    }
+                }
+            }
+        } else if (stackSize + 2 <= BVH_STACK_SIZE) {
+            /* buildBvh keeps leaves within BVH_STACK_SIZE - 1 levels, this only guards the stack memory */
+            stack[stackSize++] = node->leftFirst + 1;
+            stack[stackSize++] = node->leftFirst;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+  Returns nonzero as soon as any triangle or sphere is hit at tMin < t < tMax
+*/
+int
+isOccluded(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+    float3 rayFrom,
+    float3 rayDir,
+    float tMin,
+    float tMax
+) {
+    for (unsigned int id = 0; id < triangleCount; id++) {
+        float t, u, v;
+        if (intersectTriangle(triangles + (id * 12), rayFrom, rayDir, tMin, &t, &u, &v) && t < tMax) {
+            return 1;
+        }
+    }
+
+    for (unsigned int id = 0; id < sphereCount; id++) {
+        float t;
+        if (intersectSphere(spheres + (id * 4), rayFrom, rayDir, tMin, &t) && t < tMax) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+  Normal of the triangle or pointing out of the sphere at point
+*/
+float3
+surfaceNormal(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    unsigned int primId,
+    float3 point
+) {
+    if (primId < triangleCount) {
+        return normalize(vload3(3, triangles + (primId * 12)));
+    }
+    const __global float* sphere = spheres + ((primId - triangleCount) * 4);
+    return (point - vload3(0, sphere)) / sphere[3];
+}
+
+
+/**
+  RGBA texel of a textured material, mirrors tex_image::get
+*/
+float4
+sampleTexture(
+    const __global Material* material,
+    const __global uchar* texels,
+    unsigned int x,
+    unsigned int y
+) {
+    unsigned int realX = x >= material->texWidth ? x % material->texWidth : x;
+    unsigned int realY = y >= material->texWidth ? y % material->texHeight : y;
+    unsigned int index = material->texSize - (realY + 1) * material->texHeight * 4 + realX * 4;
+    const __global uchar* texel = texels + material->texOffset + index;
+    return (float4)(texel[0], texel[1], texel[2], texel[3]) / 255.0f;
+}
+
+
+/**
+  struct BvhNode
+    - float bboxMin[3]
+    - uint leftFirst
+    - float bboxMax[3]
+    - uint primCount
+
+  struct HitRecord
+    - float t
+    - float u
+    - float v
+    - int primId (-1 if nothing was hit)
+
+  Nearest triangle or sphere hit found by BVH traversal.
+  primIds < triangleCount address triangles, the rest address spheres shifted by triangleCount.
+*/
+__kernel void
+bvhClosestHit(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+    const __global BvhNode* nodes,
+    const __global unsigned int* primIds,
+    const __global float* raysVec,
+    const unsigned int raysCount,
+    __global HitRecord* retHits
+) {
+    unsigned int iRay = get_global_id(0);
+
+    if (iRay >= raysCount) {
+        return;
+    }
+
+    float3 rayFrom, rayDir;
+    float tMin, tMax;
+    loadRay(raysVec, iRay, &rayFrom, &rayDir, &tMin, &tMax);
+    float3 rayInvDir = inverseRayDir(rayDir);
+
+    /* closest.t doubles as the far end of the ray, nodes behind it are culled */
+    HitRecord closest;
+    closest.t = tMax;
+    closest.u = 0.0f;
+    closest.v = 0.0f;
+    closest.primId = -1;
+
+    unsigned int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const __global BvhNode* node = nodes + stack[--stackSize];
+        if (intersectBvhNode(node, rayFrom, rayInvDir, closest.t) == INFINITY) {
+            continue;
+        }
+
+        if (node->primCount > 0) {
+            for (unsigned int i = node->leftFirst; i < node->leftFirst + node->primCount; i++) {
+                unsigned int primId = primIds[i];
+                float t, u, v;
+                if (primId < triangleCount) {
+                    if (intersectTriangle(triangles + (primId * 12), rayFrom, rayDir, tMin, &t, &u, &v) &&
+                        t < closest.t) {
+                        closest.t = t;
+                        closest.u = u;
+                        closest.v = v;
+                        closest.primId = primId;
+                    }
+                } else {
+                    if (intersectSphere(spheres + ((primId - triangleCount) * 4), rayFrom, rayDir, tMin, &t) &&
+                        t < closest.t) {
+                        closest.t = t;
+                        closest.u = 0.0f;
+                        closest.v = 0.0f;
+                        closest.primId = primId;
+                    }
+                }
+            }
+        } else if (stackSize + 2 <= BVH_STACK_SIZE) {
+            /* buildBvh keeps leaves within BVH_STACK_SIZE - 1 levels, this only guards the stack memory */
+            unsigned int nearChild = node->leftFirst;
+            unsigned int farChild = node->leftFirst + 1;
+            float tNear = intersectBvhNode(nodes + nearChild, rayFrom, rayInvDir, closest.t);
+            float tFar = intersectBvhNode(nodes + farChild, rayFrom, rayInvDir, closest.t);
+            if (tFar < tNear) {
+                unsigned int tmpIdx = nearChild;
+                nearChild = farChild;
+                farChild = tmpIdx;
+                float tmpT = tNear;
+                tNear = tFar;
+                tFar = tmpT;
+            }
+            if (tFar != INFINITY) {
+                stack[stackSize++] = farChild;
+            }
+            if (tNear != INFINITY) {
+                stack[stackSize++] = nearChild;
+            }
+        }
+    }
+
+    retHits[iRay] = closest;
+}
+
+
+/**
+  Occlusion test against the BVH: retHits[i] = 1 as soon as anything is hit in the ray's (tMin, tMax), 0 otherwise.
+  For shadow rays pointing at the lamp with unnormalized direction tMax = 1 stops the ray at the lamp.
+*/
+__kernel void
+bvhAnyHit(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+    const __global BvhNode* nodes,
+    const __global unsigned int* primIds,
+    const __global float* raysVec,
+    const unsigned int raysCount,
+    __global char* retHits
+) {
+    unsigned int iRay = get_global_id(0);
+
+    if (iRay >= raysCount) {
+        return;
+    }
+
+    float3 rayFrom, rayDir;
+    float tMin, tMax;
+    loadRay(raysVec, iRay, &rayFrom, &rayDir, &tMin, &tMax);
+
+    retHits[iRay] = isOccludedBvh(triangles, triangleCount, spheres, nodes, primIds, rayFrom, rayDir, tMin, tMax)
+                    ? 1 : 0;
+}
+
+
+/**
+  Tests a ray against every triangle and sphere and keeps the nearest hit only.
+  Spheres are reported with primId = triangleCount + sphere index.
+*/
+__kernel void
+closestHit(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+    const __global float* raysVec,
+    const unsigned int raysCount,
+    __global HitRecord* retHits
+) {
+    unsigned int iRay = get_global_id(0);
+
+    if (iRay >= raysCount) {
+        return;
+    }
+
+    float3 rayFrom, rayDir;
+    float tMin, tMax;
+    loadRay(raysVec, iRay, &rayFrom, &rayDir, &tMin, &tMax);
+
+    HitRecord closest;
+    closest.t = tMax;
+    closest.u = 0.0f;
+    closest.v = 0.0f;
+    closest.primId = -1;
+
+    for (unsigned int id = 0; id < triangleCount; id++) {
+        float t, u, v;
+        if (intersectTriangle(triangles + (id * 12), rayFrom, rayDir, tMin, &t, &u, &v) && t < closest.t) {
+            closest.t = t;
+            closest.u = u;
+            closest.v = v;
+            closest.primId = id;
+        }
+    }
+
+    for (unsigned int id = 0; id < sphereCount; id++) {
+        float t;
+        if (intersectSphere(spheres + (id * 4), rayFrom, rayDir, tMin, &t) && t < closest.t) {
+            closest.t = t;
+            closest.u = 0.0f;
+            closest.v = 0.0f;
+            closest.primId = triangleCount + id;
+        }
+    }
+
+    retHits[iRay] = closest;
+}
+
+
+/**
+  Occlusion test against every triangle and sphere, stops at the first one hit in the ray's (tMin, tMax)
+*/
+__kernel void
+anyHit(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+    const __global float* raysVec,
+    const unsigned int raysCount,
+    __global char* retHits
+) {
+    unsigned int iRay = get_global_id(0);
+
+    if (iRay >= raysCount) {
+        return;
+    }
+
+    float3 rayFrom, rayDir;
+    float tMin, tMax;
+    loadRay(raysVec, iRay, &rayFrom, &rayDir, &tMin, &tMax);
+
+    retHits[iRay] = isOccluded(triangles, triangleCount, spheres, sphereCount, rayFrom, rayDir, tMin, tMax) ? 1 : 0;
+}
+
+
+/**
+  Primary rays for pixels [firstPixel, firstPixel + raysCount) of a width x height frame, pixels go row by row.
+  camX, camY, camZ are the columns of camMat, the camera looks along -z of its own space.
+  Also starts the wavefront: every ray belongs to its own pixel of the batch with weight 1.
+*/
+__kernel void
+cameraRays(
+    const float3 camPos,
+    const float3 camX,
+    const float3 camY,
+    const float3 camZ,
+    const unsigned int width,
+    const unsigned int height,
+    const unsigned int firstPixel,
+    const unsigned int raysCount,
+    __global float* retRays,
+    __global unsigned int* retPixelIds,
+    __global float* retWeights
+) {
+    unsigned int iRay = get_global_id(0);
+
+    if (iRay >= raysCount) {
+        return;
+    }
+
+    unsigned int pixel = firstPixel + iRay;
+    float x = (float) (pixel % width);
+    float y = (float) (pixel / width);
+
+    float camHeight = 0.5f;
+    float camWidth = (float) width * (camHeight / (float) height);
+    float camDist = 1.0f;
+    float dh = camHeight / (float) height;
+    float dw = camWidth / (float) width;
+    float3 rayCamDir = (float3)(-(camWidth / 2) + x * dw, -(camHeight / 2) + y * dh, -camDist);
+    float3 rayDir = normalize((float3)(dot(rayCamDir, camX), dot(rayCamDir, camY), dot(rayCamDir, camZ)));
+
+    storeRay(retRays, iRay, camPos, rayDir, RAY_T_MIN, INFINITY);
+    retPixelIds[iRay] = iRay;
+    retWeights[iRay] = 1.0f;
+}
+
+
+
+/**
+  struct Material
+    - float color[3]
+    - float diffusiveFactor
+    - float specularFactor
+    - float specularHardness
+    - float reflectionFactor
+    - int texOffset (byte offset of the RGBA texture in texels, -1 if not textured)
+    - uint texWidth
+    - uint texHeight
+    - uint texSize (texture size in bytes)
+
+  Phong shading of the closest hits with a shadow ray per lamp, plus the ambient light from reduceOcclusion
+  with ENABLE_AO. The color times the ray weight is added to the linear color of the ray's pixel in accumPixels.
+  primMaterials holds the material index of every primId, triangleUvs 6 floats (uvStart, uvU, uvV) per triangle,
+  lamps 5 floats (pos, intensity, distance) per lamp.
+  If spawnReflections is set, retBounceFlags[i] = 1 marks rays whose material reflects,
+  retBounceRays[i] and retBounceWeights[i] then hold the reflected ray.
+*/
+__kernel void
+shadeHits(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+#ifdef ENABLE_BVH
+    const __global BvhNode* nodes,
+    const __global unsigned int* primIds,
+#endif
+    const __global Material* materials,
+    const __global unsigned int* primMaterials,
+    const __global float* triangleUvs,
+    const __global uchar* texels,
+    const __global float* lamps,
+    const unsigned int lampCount,
+    const float3 horizonColor,
+    const __global float* raysVec,
+    const __global HitRecord* hits,
+    const __global unsigned int* pixelIds,
+    const __global float* weights,
+#ifdef ENABLE_AO
+    const __global float* aoFactors,
+#endif
+    const unsigned int raysCount,
+    const unsigned int spawnReflections,
+    __global float* accumPixels,
+    __global float* retBounceRays,
+    __global float* retBounceWeights,
+    __global unsigned int* retBounceFlags
+) {
+    unsigned int iRay = get_global_id(0);
+
+    if (iRay >= raysCount) {
+        return;
+    }
+
+    unsigned int pixelId = pixelIds[iRay];
+    float weight = weights[iRay];
+    HitRecord hit = hits[iRay];
+    if (hit.primId < 0) {
+        vstore3(vload3(pixelId, accumPixels) + weight * horizonColor, pixelId, accumPixels);
+        if (spawnReflections) {
+            retBounceFlags[iRay] = 0;
+        }
+        return;
+    }
+
+    float3 rayFrom, rayDir;
+    float tMin, tMax;
+    loadRay(raysVec, iRay, &rayFrom, &rayDir, &tMin, &tMax);
+    float3 point = rayFrom + hit.t * rayDir;
+
+    unsigned int primId = (unsigned int) hit.primId;
+    const __global Material* material = materials + primMaterials[primId];
+    float3 surfaceColor = (float3)(material->color[0], material->color[1], material->color[2]);
+    float3 norm = surfaceNormal(triangles, triangleCount, spheres, primId, point);
+    if (primId < triangleCount) {
+        if (material->texOffset >= 0) {
+            const __global float* uvs = triangleUvs + (primId * 6);
+            float2 uv = vload2(0, uvs) + vload2(1, uvs) * hit.u + vload2(2, uvs) * hit.v;
+            float4 rgba = sampleTexture(material, texels, (unsigned int) uv.x, (unsigned int) uv.y);
+            surfaceColor = rgba.w * (float3)(rgba.x, rgba.y, rgba.z) + (1.0f - rgba.w) * surfaceColor;
         }
     }
 
-    retHit[iRay * sphereCount + id] = 1;
-    float3 hitPt = rayFrom + t * rayDir;
-    float3 norm = (hitPt - center) / radius;
+    float3 color = (float3)(0.0f, 0.0f, 0.0f);
+#ifdef ENABLE_AO
+    color += surfaceColor * aoFactors[iRay];
+#endif
+    float dotWithDir = dot(rayDir, norm);
+    for (unsigned int i = 0; i < lampCount; i++) {
+        const __global float* lamp = lamps + (i * 5);
+        float intensity = lamp[3];
+        float distance = lamp[4];
+        float3 toLamp = vload3(0, lamp) - point;
+        float dotWithLamp = dot(toLamp, norm);
+        if (!((dotWithDir < 0.0f && dotWithLamp >= 0.0f) || (dotWithDir > 0.0f && dotWithLamp <= 0.0f))) {
+            continue;
+        }
+
+        /* toLamp is not normalized, so the lamp itself is at t = 1 */
+#ifdef ENABLE_BVH
+        if (isOccludedBvh(triangles, triangleCount, spheres, nodes, primIds, point, toLamp, RAY_T_MIN, 1.0f)) {
+            continue;
+        }
+#else
+        if (isOccluded(triangles, triangleCount, spheres, sphereCount, point, toLamp, RAY_T_MIN, 1.0f)) {
+            continue;
+        }
+#endif
+
+        /* diffusive */
+        float sqrLength = dot(toLamp, toLamp);
+        color += surfaceColor * material->diffusiveFactor * intensity * distance * fabs(dotWithLamp) / sqrLength;
+
+        /* specular */
+        float3 toLampReflected = normalize(toLamp - 2.0f * norm * dotWithLamp);
+        float specDot = dot(toLampReflected, rayDir);
+        float specLight = fmax(0.0f, (material->specularHardness * distance / sqrLength) *
+                                     pow(specDot, material->specularHardness));
+        color += surfaceColor * material->specularFactor * specLight;
+    }
+
+    vstore3(vload3(pixelId, accumPixels) + weight * color, pixelId, accumPixels);
+
+    if (spawnReflections) {
+        unsigned int reflects = material->reflectionFactor > EPS ? 1 : 0;
+        retBounceFlags[iRay] = reflects;
+        if (reflects) {
+            storeRay(retBounceRays, iRay, point, rayDir - 2.0f * norm * dotWithDir, RAY_T_MIN, INFINITY);
+            retBounceWeights[iRay] = weight * material->reflectionFactor;
+        }
+    }
+}
+
+
+
+/**
+  One occlusion ray per hit and sample, the work size is {raysCount, AO_RAYS_COUNT}.
+  Directions are uniform in the cube flipped to the viewer's side of the surface, as in the CPU tracer,
+  random numbers are keyed by the pixel of the frame and counted by bounce and sample.
+  retVisible[i * AO_RAYS_COUNT + sample] is 1 if the sample ray escapes, 0 if it is blocked or there is no hit.
+*/
+__kernel void
+ambientOcclusionRays(
+    const __global float* triangles,
+    const unsigned int triangleCount,
+    const __global float* spheres,
+    const unsigned int sphereCount,
+#ifdef ENABLE_BVH
+    const __global BvhNode* nodes,
+    const __global unsigned int* primIds,
+#endif
+    const __global float* raysVec,
+    const __global HitRecord* hits,
+    const __global unsigned int* pixelIds,
+    const unsigned int firstPixel,
+    const unsigned int bounce,
+    const unsigned int raysCount,
+    __global uchar* retVisible
+) {
+    unsigned int iRay = get_global_id(0);
+    unsigned int iSample = get_global_id(1);
+
+    if (iRay >= raysCount) {
+        return;
+    }
+
+    uchar visible = 0;
+    HitRecord hit = hits[iRay];
+    if (hit.primId >= 0) {
+        float3 rayFrom, rayDir;
+        float tMin, tMax;
+        loadRay(raysVec, iRay, &rayFrom, &rayDir, &tMin, &tMax);
+        float3 point = rayFrom + hit.t * rayDir;
+        float3 norm = surfaceNormal(triangles, triangleCount, spheres, (unsigned int) hit.primId, point);
+        float3 realNorm = dot(rayDir, norm) < 0.0f ? norm : -norm;
 
-    __global float* retHitParam = retHitParams + (iRay * 7 * sphereCount) + (id * 7);
-    retHitParam[0] = t;
-    retHitParam[1] = hitPt.x;
-    retHitParam[2] = hitPt.y;
-    retHitParam[3] = hitPt.z;
-    retHitParam[4] = norm.x;
-    retHitParam[5] = norm.y;
-    retHitParam[6] = norm.z;
+        /* the device traces a single camera sample per pixel, see randomKey in counter_rng.h */
+        unsigned int key = randomKey(firstPixel + pixelIds[iRay], 0);
+        unsigned int counter = (bounce * AO_RAYS_COUNT + iSample) * 3;
+        float3 sampleDir = (float3)(
+            2.0f * randomFloat(key, counter) - 1.0f,
+            2.0f * randomFloat(key, counter + 1) - 1.0f,
+            2.0f * randomFloat(key, counter + 2) - 1.0f
+        );
+        if (dot(sampleDir, realNorm) < EPS) {
+            sampleDir = -sampleDir;
+        }
+
+#ifdef ENABLE_BVH
+        visible = isOccludedBvh(
+            triangles, triangleCount, spheres, nodes, primIds, point, sampleDir, RAY_T_MIN, INFINITY
+        ) ? 0 : 1;
+#else
+        visible = isOccluded(
+            triangles, triangleCount, spheres, sphereCount, point, sampleDir, RAY_T_MIN, INFINITY
+        ) ? 0 : 1;
+#endif
+    }
+
+    retVisible[iRay * AO_RAYS_COUNT + iSample] = visible;
 }
 
+
+/**
+  Ambient light of every hit: ambientFactor times the share of AO samples that escaped
+*/
+__kernel void
+reduceOcclusion(
+    const __global uchar* visible,
+    const unsigned int raysCount,
+    const float ambientFactor,
+    __global float* retFactors
+) {
+    unsigned int iRay = get_global_id(0);
+
+    if (iRay >= raysCount) {
+        return;
+    }
+
+    unsigned int visibleCount = 0;
+    for (unsigned int i = 0; i < AO_RAYS_COUNT; i++) {
+        visibleCount += visible[iRay * AO_RAYS_COUNT + i];
+    }
+    retFactors[iRay] = ambientFactor * (float) visibleCount / (float) AO_RAYS_COUNT;
+}
+
+
+/**
+  Exclusive prefix sum of values within every work-group, the group totals go to retGroupSums.
+  temp holds one uint per work item.
+*/
+__kernel void
+scanGroups(
+    const __global unsigned int* values,
+    const unsigned int count,
+    __global unsigned int* retOffsets,
+    __global unsigned int* retGroupSums,
+    __local unsigned int* temp
+) {
+    unsigned int gid = get_global_id(0);
+    unsigned int lid = get_local_id(0);
+    unsigned int size = get_local_size(0);
+
+    unsigned int value = gid < count ? values[gid] : 0;
+    temp[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    /* Hillis-Steele inclusive scan, work-groups are small enough for the extra additions not to matter */
+    for (unsigned int offset = 1; offset < size; offset <<= 1) {
+        unsigned int add = lid >= offset ? temp[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        temp[lid] += add;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (gid < count) {
+        retOffsets[gid] = temp[lid] - value;
+    }
+    if (lid == size - 1) {
+        retGroupSums[get_group_id(0)] = temp[lid];
+    }
+}
+
+
+
+/**
+  Turns per group prefix sums into global ones, groupOffsets is the exclusive prefix sum of the group totals
+*/
+__kernel void
+addGroupOffsets(
+    __global unsigned int* offsets,
+    const unsigned int count,
+    const __global unsigned int* groupOffsets
+) {
+    unsigned int gid = get_global_id(0);
+
+    if (gid < count) {
+        offsets[gid] += groupOffsets[get_group_id(0)];
+    }
+}
+
+
+
+/**
+  Moves the flagged bounce rays to offsets[i] of the next wavefront, offsets is the exclusive prefix sum of flags.
+  The size of the next wavefront goes to retCount.
+*/
+__kernel void
+compactRays(
+    const __global unsigned int* flags,
+    const __global unsigned int* offsets,
+    const unsigned int raysCount,
+    const __global float* bounceRays,
+    const __global unsigned int* pixelIds,
+    const __global float* bounceWeights,
+    __global float* retRays,
+    __global unsigned int* retPixelIds,
+    __global float* retWeights,
+    __global unsigned int* retCount
+) {
+    unsigned int iRay = get_global_id(0);
+
+    if (iRay >= raysCount) {
+        return;
+    }
+
+    if (iRay == raysCount - 1) {
+        *retCount = offsets[iRay] + flags[iRay];
+    }
+
+    if (!flags[iRay]) {
+        return;
+    }
+
+    unsigned int dst = offsets[iRay];
+    vstore4(vload4(iRay * 2, bounceRays), dst * 2, retRays);
+    vstore4(vload4(iRay * 2 + 1, bounceRays), dst * 2 + 1, retRays);
+    retPixelIds[dst] = pixelIds[iRay];
+    retWeights[dst] = bounceWeights[iRay];
+}
+
+
+
+/**
+  Gamma correction of the accumulated linear colors, in place
+*/
+__kernel void
+finishPixels(
+    __global float* pixels,
+    const unsigned int pixelCount
+) {
+    unsigned int iPixel = get_global_id(0);
+
+    if (iPixel >= pixelCount) {
+        return;
+    }
+
+    vstore3(pow(vload3(iPixel, pixels) / 2.2f, (float3)(0.3f)), iPixel, pixels);
+}
@@ -8,15 +8,46 @@
 #define WIDTH (800)
 #define HEIGHT (600)
 //#define RENDER_PARALLEL
+/** CPU preview that refines one jittered sample per pixel per pass and restarts when the camera moves */
+//#define RENDER_PROGRESSIVE
+#define PROGRESSIVE_MAX_PASSES (1024)
+#define CAMERA_MOVE_SPEED (2.0f)
+#define CAMERA_TURN_SPEED (0.005f)
 #define GPU_ACCELERATION
 //#define ENABLE_AO
 //#define ENABLE_REFLECTION
 #define RENDER_COUNT (1)
+/** rays per pixel on the CPU; with ENABLE_ADAPTIVE_AA only pixels on edges get more than one */
+#define AA_MAX_SAMPLES (4)
+#define ENABLE_ADAPTIVE_AA
+#define AA_NORMAL_THRESHOLD (0.95f)
+#define AA_COLOR_THRESHOLD (0.1f)
 #define AO_RAYS_COUNT (30)
+/** CPU only: reuse AO samples between nearby hits and frames, renders then depend on the order of the tiles */
+//#define ENABLE_AO_CACHE
+#define AO_CACHE_MAX_ERROR (0.4f)
+#define AO_CACHE_MIN_RADIUS (0.05f)
+#define AO_CACHE_MAX_RADIUS (2.0f)
+#define AO_CACHE_LOCK_STRIPES (64)
 #define MAX_REFLECTION_DEPTH (2)
 #define THREAD_POOL_SIZE (1)
 #define SUB_BLOCK_WIDTH (48)
 #define SUB_BLOCK_HEIGHT (48)
+#define CL_PIPELINE_DEPTH (2)
+#define CL_BATCH_RAYS (1 << 18)
+#define CL_BINARY_CACHE_DIR ".cache/ray_tracing"
+#define CL_DEVICES "gpu"
+#define CL_BANDS_PER_DEVICE (8)
+#define CL_SCAN_GROUP_SIZE (256)
 #define EPS (0.0001)
+/**
+  Near end of the rays traced on the device, keeps a ray from hitting the surface it starts on
+*/
+#define RAY_T_MIN (0.001f)
+#define ENABLE_BVH
+#define BVH_MAX_LEAF_SIZE (4)
+#define BVH_BIN_COUNT (12)
+#define BVH_STACK_SIZE (64)
+#define ENABLE_RAY_PACKETS
 
 #endif //RAY_TRACING_CONFIG_H
@@ -0,0 +1,56 @@
+#ifndef RAY_TRACING_COUNTER_RNG_H
+#define RAY_TRACING_COUNTER_RNG_H
+
+/**
+  Counter-based random numbers shared by the CPU tracer and the OpenCL kernels.
+  The file is plain C that builds as C++ and as OpenCL C, CMake prepends it to the kernel sources.
+  A value only depends on its key and counter, so there is no generator state to lock or to share between
+  threads and work items, and a pixel gets the same samples on any thread, device or run.
+*/
+
+#ifdef __OPENCL_VERSION__
+#define RNG_INLINE
+#else
+#define RNG_INLINE inline
+#endif
+
+
+/**
+  PCG output permutation over a single 32-bit state (Jarzynski and Olano, "Hash Functions for GPU Rendering")
+*/
+RNG_INLINE unsigned int
+pcgHash(
+    unsigned int x
+) {
+    unsigned int state = x * 747796405u + 2891336453u;
+    unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+
+/**
+  Key of the random stream of one sample of one pixel
+*/
+RNG_INLINE unsigned int
+randomKey(
+    unsigned int pixel,
+    unsigned int sample
+) {
+    return pcgHash(pixel + pcgHash(sample));
+}
+
+
+/**
+  Value number counter of the stream key, uniform in [0, 1)
+*/
+RNG_INLINE float
+randomFloat(
+    unsigned int key,
+    unsigned int counter
+) {
+    return (float) (pcgHash(key ^ pcgHash(counter)) >> 8) * (1.0f / 16777216.0f);
+}
+
+#undef RNG_INLINE
+
+#endif //RAY_TRACING_COUNTER_RNG_H
@@ -5,9 +5,56 @@
 #ifndef RAY_TRACING_IMAGEBITMAP_H
 #define RAY_TRACING_IMAGEBITMAP_H
 
+#include <algorithm>
 #include <memory>
 #include <cstring>
 
+/**
+  Writable view of a rectangle of an image_bitmap. Views of disjoint rectangles can be filled from different threads,
+  the view doesn't own the pixels and must not outlive the bitmap
+*/
+class image_tile {
+private:
+    float* mData;
+    int mStride;
+    int mX;
+    int mY;
+    int mWidth;
+    int mHeight;
+
+public:
+    image_tile(float* data, int stride, int x, int y, int width, int height)
+            : mData(data), mStride(stride), mX(x), mY(y), mWidth(width), mHeight(height) {}
+
+    /* x and y are relative to the tile and must be inside it */
+    inline void setPixel(int x, int y, float r, float g, float b) {
+        float* needPixelPtr = mData + mStride * y + x * 3;
+        needPixelPtr[0] = r;
+        needPixelPtr[1] = g;
+        needPixelPtr[2] = b;
+    }
+
+    inline float* getPixel(int x, int y) const {
+        return mData + mStride * y + x * 3;
+    }
+
+    inline int getX() const {
+        return mX;
+    }
+
+    inline int getY() const {
+        return mY;
+    }
+
+    inline int getWidth() const {
+        return mWidth;
+    }
+
+    inline int getHeight() const {
+        return mHeight;
+    }
+};
+
 class image_bitmap {
 private:
     float* mData;
@@ -60,6 +107,15 @@ public:
         return mWidth;
     }
 
+    /* the rectangle is clipped to the bitmap */
+    inline image_tile getTile(int x, int y, int width, int height) const {
+        x = std::min(std::max(x, 0), mWidth);
+        y = std::min(std::max(y, 0), mHeight);
+        width = std::max(std::min(width, mWidth - x), 0);
+        height = std::max(std::min(height, mHeight - y), 0);
+        return image_tile(getPixel(x, y), mWidth * 3, x, y, width, height);
+    }
+
     inline void clear() {
         memset(mData, 0, (size_t) (mWidth * mHeight * 3 * sizeof(float)));
     }
@@ -8,9 +8,12 @@
 #include <fstream>
 
 #include "image_bitmap.h"
-#include "synchronized_queue.h"
+#include "mpsc_queue.h"
 #include "ray_tracer.h"
+#include "thread_pool.h"
+#include "camera_input.h"
 #include "ray_tracer_cl.h"
+#include "opencl_executor.h"
 #include "lib/json.h"
 
 void render(const image_bitmap &img);
@@ -22,8 +25,7 @@ std::ostream &operator<<(std::ostream &os, glm::vec3 x);
 int main() {
     std::shared_ptr<Scene> scene(new Scene());
     std::shared_ptr<image_bitmap> img(new image_bitmap(WIDTH, HEIGHT));
-    std::shared_ptr<synchronized_queue<std::tuple<int, int, std::shared_ptr<image_bitmap>>>> queue(
-            new synchronized_queue<std::tuple<int, int, std::shared_ptr<image_bitmap>>>());
+    std::shared_ptr<mpsc_queue<std::tuple<int, int, int, int>>> queue(new mpsc_queue<std::tuple<int, int, int, int>>());
     loadScene(*scene, "/home/vlad/projects/blender/hello.scene");
 
     if (!glfwInit()) {
@@ -50,39 +52,96 @@ int main() {
 
     glClearColor(1, 1, 1, 1);
 
-#ifdef RENDER_PARALLEL
+#if defined(RENDER_PROGRESSIVE)
+    thread_pool pool(THREAD_POOL_SIZE);
+    std::shared_ptr<image_bitmap> accumImg(new image_bitmap(WIDTH, HEIGHT));
+    camera_input cameraInput(mainWindow, *scene);
+    std::shared_future<void> passDone;
+    uint32_t passIdx = 0;
+
+    while (glfwWindowShouldClose(mainWindow) == GL_FALSE) {
+        cameraInput.poll();
+
+        bool finished = !passDone.valid() ||
+                        passDone.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        if (finished) {
+            if (passDone.valid()) {
+                passDone.get();
+                passDone = std::shared_future<void>();
+                render(*img);
+            }
+
+            /* the scene is only touched between passes, workers read it while one runs */
+            if (cameraInput.apply(*scene)) {
+                passIdx = 0;
+            }
+            if (passIdx < PROGRESSIVE_MAX_PASSES) {
+                passDone = renderProgressivePass(pool, scene, accumImg, img, passIdx, WIDTH, HEIGHT);
+                passIdx++;
+            }
+        }
+
+        glfwSwapBuffers(mainWindow);
+        glfwPollEvents();
+    }
+
+    if (passDone.valid()) {
+        passDone.wait();
+    }
+#elif defined(RENDER_PARALLEL)
+    thread_pool pool(THREAD_POOL_SIZE);
     bool timePrinted = false;
     int renderTimesLeft = RENDER_COUNT;
-    std::shared_ptr<bool> finishedFlag(new bool(true));
+    std::shared_future<void> frameDone;
     std::vector<long> durations;
     auto start = std::chrono::high_resolution_clock::now();
 
-    while (glfwWindowShouldClose(mainWindow) == GL_FALSE) {
-        if (*finishedFlag && renderTimesLeft > 0) {
-            img->clear();
-            finishedFlag = renderParallel(scene, queue, WIDTH, HEIGHT);
-            start = std::chrono::high_resolution_clock::now();
-            renderTimesLeft--;
-        }
+    /*
+      Workers keep writing img while a frame runs, so the window shows displayImg instead.
+      A block is copied over only once its worker has pushed it, and the copy never overlaps a block in progress
+    */
+    image_bitmap displayImg(WIDTH, HEIGHT);
+    auto publishBlocks = [&]() {
+        return queue->drain([&](std::tuple<int, int, int, int> &&block) {
+            image_tile src = img->getTile(std::get<0>(block), std::get<1>(block), std::get<2>(block),
+                                          std::get<3>(block));
+            image_tile dst = displayImg.getTile(src.getX(), src.getY(), src.getWidth(), src.getHeight());
+            for (int i = 0; i < src.getHeight(); i++) {
+                memcpy(dst.getPixel(0, i), src.getPixel(0, i), sizeof(float) * 3 * src.getWidth());
+            }
+        });
+    };
 
-        if (*finishedFlag) {
+    while (glfwWindowShouldClose(mainWindow) == GL_FALSE) {
+        bool finished = !frameDone.valid() ||
+                        frameDone.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        if (finished && frameDone.valid()) {
+            frameDone.get();
+            frameDone = std::shared_future<void>();
             auto end = std::chrono::high_resolution_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
             durations.push_back(duration);
         }
 
-        if (*finishedFlag && renderTimesLeft == 0 && !timePrinted) {
+        if (finished && renderTimesLeft > 0) {
+            /* blocks of the last frame are taken over before img is reused */
+            publishBlocks();
+            img->clear();
+            displayImg.clear();
+            start = std::chrono::high_resolution_clock::now();
+            frameDone = renderParallel(pool, scene, img, queue, WIDTH, HEIGHT);
+            finished = false;
+            renderTimesLeft--;
+        }
+
+        if (finished && renderTimesLeft == 0 && !timePrinted) {
             long sum = std::accumulate(durations.begin(), durations.end(), 0);
             std::cout << "Время выполнения: " << static_cast<double>(sum) / durations.size() << std::endl;
             timePrinted = true;
         }
 
-        try {
-            auto subBlock = queue->pop_back();
-            img->copyImageTo(std::get<0>(subBlock), std::get<1>(subBlock), *std::get<2>(subBlock));
-            render(*img);
-        } catch (std::out_of_range &e) {
-            // unused
+        if (publishBlocks() > 0) {
+            render(displayImg);
         }
 
         glfwSwapBuffers(mainWindow);
@@ -90,10 +149,18 @@ int main() {
     }
 #else
     std::vector<long> durations;
+#ifdef GPU_ACCELERATION
+    const char *clDevices = getenv("RAY_TRACING_CL_DEVICES");
+    std::shared_ptr<OpenClMultiExecutor> clExecutor(
+            new OpenClMultiExecutor(*scene, clDevices != nullptr ? clDevices : CL_DEVICES));
+    for (size_t i = 0; i < clExecutor->getDeviceCount(); i++) {
+        std::cout << "OpenCL device: " << clExecutor->getExecutor(i)->getDeviceName() << std::endl;
+    }
+#endif
     for (int i = 0; i < RENDER_COUNT; i++) {
         auto start = std::chrono::high_resolution_clock::now();
 #ifdef GPU_ACCELERATION
-        renderSceneCl(*img, *scene);
+        renderSceneCl(*img, *scene, clExecutor);
 #else
         renderScene(*img, *scene);
 #endif
@@ -0,0 +1,88 @@
+#ifndef RAY_TRACING_MPSC_QUEUE_H
+#define RAY_TRACING_MPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <utility>
+
+/**
+  Lock-free multi-producer single-consumer queue (Vyukov's node-based MPSC).
+  Producers swing mHead with one atomic exchange and never wait on each other or on the consumer.
+  try_pop and drain must only be called from one thread. T must be default constructible for the stub node.
+*/
+template<typename T>
+class mpsc_queue {
+private:
+    typedef struct _Node {
+        std::atomic<_Node *> next;
+        T value;
+
+        _Node() : next(nullptr) {}
+
+        explicit _Node(const T &item) : next(nullptr), value(item) {}
+    } Node;
+
+    /* most recently pushed node, shared by the producers */
+    std::atomic<Node *> mHead;
+    /* stub node in front of the oldest item, owned by the consumer */
+    Node *mTail;
+
+    mpsc_queue(const mpsc_queue &queue) = delete;
+
+    mpsc_queue &operator=(const mpsc_queue &queue) = delete;
+
+public:
+    mpsc_queue() {
+        Node *stub = new Node();
+        mHead.store(stub, std::memory_order_relaxed);
+        mTail = stub;
+    }
+
+    ~mpsc_queue() {
+        while (mTail != nullptr) {
+            Node *next = mTail->next.load(std::memory_order_relaxed);
+            delete mTail;
+            mTail = next;
+        }
+    }
+
+    void push(const T &item) {
+        Node *node = new Node(item);
+        Node *prev = mHead.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    /**
+      Moves the oldest item to item and returns true, or returns false if there is none.
+      An item whose producer is between the exchange and the link is reported on a later call
+    */
+    bool try_pop(T &item) {
+        Node *next = mTail->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            return false;
+        }
+        item = std::move(next->value);
+        next->value = T();
+        delete mTail;
+        mTail = next;
+        return true;
+    }
+
+    /**
+      Pops up to maxCount items, in push order, into fn(T &&) and returns how many were handed out
+    */
+    template<typename F>
+    size_t drain(F fn, size_t maxCount = std::numeric_limits<size_t>::max()) {
+        size_t count = 0;
+        T item;
+        while (count < maxCount && try_pop(item)) {
+            fn(std::move(item));
+            count++;
+        }
+        return count;
+    }
+};
+
+
+#endif //RAY_TRACING_MPSC_QUEUE_H
@@ -3,65 +3,177 @@
 //
 
 #include <fstream>
+#include <sstream>
+#include <iterator>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <utility>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "opencl_executor.h"
+#include "cl_kernels_source.h"
 
-OpenClExecutor::OpenClExecutor(const Scene &scene)
-        : mContext(0), mCommandQueue(0), mProgram(0)
-        , mKrnHitTriangle(0), mTriangles(nullptr), mMemTriangles(0)
-        , mKrnHitSphere(0), mSpheres(nullptr), mMemSpheres(0) {
-    cl_int err;
 
-    /* Creating context */
-    cl_uint platformCount;
-    err = clGetPlatformIDs(0, nullptr, &platformCount);
-    checkClResult(err, "clGetPlatformIDs count");
-    if (platformCount == 0) {
-        throw std::runtime_error("platform count == 0");
+/**
+  64 bit FNV-1a, good enough to tell kernel sources and build configurations apart
+*/
+static uint64_t
+fnv1a(
+        const std::string &data,
+        uint64_t hash = 14695981039346656037ULL
+) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
     }
+    return hash;
+}
+
 
-    cl_platform_id platformIds[platformCount];
-    err = clGetPlatformIDs(platformCount, platformIds, nullptr);
-    checkClResult(err, "clGetPlatformIds");
+static std::string
+deviceInfoString(
+        cl_device_id deviceId,
+        cl_device_info param
+) {
+    size_t size = 0;
+    if (clGetDeviceInfo(deviceId, param, 0, nullptr, &size) != CL_SUCCESS || size == 0) {
+        return std::string();
+    }
+    std::vector<char> value(size);
+    if (clGetDeviceInfo(deviceId, param, size, value.data(), nullptr) != CL_SUCCESS) {
+        return std::string();
+    }
+    return std::string(value.data());
+}
 
-    cl_context_properties contextProperties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties) platformIds[0], 0};
-    mContext = clCreateContextFromType(contextProperties, CL_DEVICE_TYPE_GPU, nullptr, nullptr, &err);
-    checkClResult(err, "clCreateContextFromType");
 
-    /* Creating command queue */
-    size_t actualSize = 0;
-    cl_device_id deviceId;
-    err = clGetContextInfo(mContext, CL_CONTEXT_DEVICES, sizeof(deviceId), &deviceId, &actualSize);
-    checkClResult(err, "clGetContextInfo (deviceId)");
-    if (actualSize == 0) {
-        throw std::runtime_error("no devices");
+/**
+  Directory for cached program binaries: $RAY_TRACING_CL_CACHE if set, otherwise CL_BINARY_CACHE_DIR under $HOME.
+  Empty if caching is disabled or there is no place to put it
+*/
+static std::string
+binaryCacheDir() {
+#ifdef CL_BINARY_CACHE_DIR
+    const char *dir = getenv("RAY_TRACING_CL_CACHE");
+    if (dir != nullptr) {
+        return dir;
     }
+    const char *home = getenv("HOME");
+    if (home != nullptr && home[0] != '\0') {
+        return std::string(home) + "/" + CL_BINARY_CACHE_DIR;
+    }
+#endif
+    return std::string();
+}
 
-    mCommandQueue = clCreateCommandQueue(mContext, deviceId, 0, &err);
-    checkClResult(err, "clCreateCommandQueue");
 
-    /* loading kernels */
-    std::ifstream ifstream("cl_kernels.c");
-    std::string line;
-    std::string progSource;
-    while (std::getline(ifstream, line)) {
-        progSource += line;
-        progSource += "\n";
-    }
-
-    cl_uint numProgs = 1;
-    size_t progLengthArray[] = {progSource.size()};
-    const char *progSourceRaw = progSource.data();
-    mProgram = clCreateProgramWithSource(mContext, numProgs, &progSourceRaw, progLengthArray, &err);
-    checkClResult(err, "clCreateProgramWithSource");
+static void
+makeDirs(
+        const std::string &path
+) {
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '/') {
+            mkdir(path.substr(0, i).c_str(), 0755);
+        }
+    }
+}
 
-    err = clBuildProgram(mProgram, 0, nullptr, nullptr, nullptr, nullptr);
-    checkClResult(err, "clBuildProgram");
+OpenClExecutor::OpenClExecutor(const Scene &scene, cl_device_id deviceId)
+        : mContext(0), mCommandQueue(0), mProgram(0)
+        , mTriangles(nullptr), mMemTriangles(0)
+        , mSpheres(nullptr), mMemSpheres(0)
+        , mMemBvhNodes(0), mMemBvhPrimIds(0)
+        , mMemMaterials(0), mMemPrimMaterials(0), mMemTriangleUvs(0), mMemTexels(0), mLampCount(0), mMemLamps(0)
+        , mAmbientFactor(0.0f)
+        , mKrnClosestHit(0), mKrnAnyHit(0), mKrnCameraRays(0), mKrnShadeHits(0)
+        , mKrnAmbientOcclusionRays(0), mKrnReduceOcclusion(0)
+        , mKrnScanGroups(0), mKrnAddGroupOffsets(0), mKrnCompactRays(0), mKrnFinishPixels(0), mScanGroupSize(1) {
+    cl_int err;
 
-    mKrnHitTriangle = clCreateKernel(mProgram, "triangleHit", &err);
-    checkClResult(err, "clCreateKernel (triangleHit)");
+    mDeviceName = deviceInfoString(deviceId, CL_DEVICE_NAME);
 
-    mKrnHitSphere = clCreateKernel(mProgram, "sphereHit", &err);
-    checkClResult(err, "clCreateKernel (sphereHit)");
+    /* Creating context */
+    cl_platform_id platformId;
+    err = clGetDeviceInfo(deviceId, CL_DEVICE_PLATFORM, sizeof(platformId), &platformId, nullptr);
+    checkClResult(err, "clGetDeviceInfo (platform)");
+
+    cl_context_properties contextProperties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties) platformId, 0};
+    mContext = clCreateContext(contextProperties, 1, &deviceId, nullptr, nullptr, &err);
+    checkClResult(err, "clCreateContext");
+
+    /* Creating command queue */
+    mCommandQueue = clCreateCommandQueue(mContext, deviceId, 0, &err);
+    checkClResult(err, "clCreateCommandQueue");
+
+    /* loading kernels */
+    std::string buildOptions = "-D BVH_STACK_SIZE=" + std::to_string(BVH_STACK_SIZE);
+#ifdef ENABLE_BVH
+    buildOptions += " -D ENABLE_BVH";
+#endif
+#ifdef ENABLE_AO
+    buildOptions += " -D ENABLE_AO";
+#endif
+    buildOptions += " -D AO_RAYS_COUNT=" + std::to_string(AO_RAYS_COUNT);
+    buildOptions += " -D EPS=" + std::to_string(static_cast<float>(EPS)) + "f";
+    buildOptions += " -D RAY_T_MIN=" + std::to_string(static_cast<float>(RAY_T_MIN)) + "f";
+    mProgram = buildProgram(deviceId, CL_KERNELS_SOURCE, buildOptions);
+
+#ifdef ENABLE_BVH
+    mKrnClosestHit = clCreateKernel(mProgram, "bvhClosestHit", &err);
+    checkClResult(err, "clCreateKernel (bvhClosestHit)");
+
+    mKrnAnyHit = clCreateKernel(mProgram, "bvhAnyHit", &err);
+    checkClResult(err, "clCreateKernel (bvhAnyHit)");
+#else
+    mKrnClosestHit = clCreateKernel(mProgram, "closestHit", &err);
+    checkClResult(err, "clCreateKernel (closestHit)");
+
+    mKrnAnyHit = clCreateKernel(mProgram, "anyHit", &err);
+    checkClResult(err, "clCreateKernel (anyHit)");
+#endif
+
+    mKrnCameraRays = clCreateKernel(mProgram, "cameraRays", &err);
+    checkClResult(err, "clCreateKernel (cameraRays)");
+
+    mKrnShadeHits = clCreateKernel(mProgram, "shadeHits", &err);
+    checkClResult(err, "clCreateKernel (shadeHits)");
+
+    mKrnAmbientOcclusionRays = clCreateKernel(mProgram, "ambientOcclusionRays", &err);
+    checkClResult(err, "clCreateKernel (ambientOcclusionRays)");
+
+    mKrnReduceOcclusion = clCreateKernel(mProgram, "reduceOcclusion", &err);
+    checkClResult(err, "clCreateKernel (reduceOcclusion)");
+
+    mKrnScanGroups = clCreateKernel(mProgram, "scanGroups", &err);
+    checkClResult(err, "clCreateKernel (scanGroups)");
+
+    mKrnAddGroupOffsets = clCreateKernel(mProgram, "addGroupOffsets", &err);
+    checkClResult(err, "clCreateKernel (addGroupOffsets)");
+
+    mKrnCompactRays = clCreateKernel(mProgram, "compactRays", &err);
+    checkClResult(err, "clCreateKernel (compactRays)");
+
+    mKrnFinishPixels = clCreateKernel(mProgram, "finishPixels", &err);
+    checkClResult(err, "clCreateKernel (finishPixels)");
+
+    /* both scan kernels run with the same power of two work-group size */
+    size_t maxGroupSize = CL_SCAN_GROUP_SIZE;
+    for (cl_kernel kernel : {mKrnScanGroups, mKrnAddGroupOffsets}) {
+        size_t kernelGroupSize = 0;
+        err = clGetKernelWorkGroupInfo(
+                kernel, deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelGroupSize), &kernelGroupSize, nullptr
+        );
+        checkClResult(err, "clGetKernelWorkGroupInfo (scan)");
+        maxGroupSize = std::min(maxGroupSize, kernelGroupSize);
+    }
+    while (mScanGroupSize * 2 <= maxGroupSize) {
+        mScanGroupSize *= 2;
+    }
+    if (mScanGroupSize < 2) {
+        throw std::runtime_error("device can't run the scan kernels");
+    }
 
     /* process scene data */
     mTriangleCount = scene.triangles.size();
@@ -74,7 +186,7 @@ OpenClExecutor::OpenClExecutor(const Scene &scene)
         checkClResult(err, "clCreateBuffer (triangles)");
 
         for (size_t i = 0; i < mTriangleCount; i++) {
-            putTriangle(*scene.triangles[i], mTriangles + (i * 12));
+            putTriangle(scene.triangles, i, mTriangles + (i * 12));
         }
 
         err = clEnqueueWriteBuffer(
@@ -95,7 +207,7 @@ OpenClExecutor::OpenClExecutor(const Scene &scene)
         checkClResult(err, "clCreateBuffer (spheres)");
 
         for (size_t i = 0; i < scene.spheres.size(); i++) {
-            putSphere(*scene.spheres[i], mSpheres + (i * 4));
+            putSphere(scene.spheres, i, mSpheres + (i * 4));
         }
 
         err = clEnqueueWriteBuffer(
@@ -105,9 +217,78 @@ OpenClExecutor::OpenClExecutor(const Scene &scene)
         );
         checkClResult(err, "clEnqueueWriteBuffer (spheres write)");
     }
+
+    static_assert(sizeof(BvhNode) == 8 * sizeof(cl_float), "BvhNode must match the device layout");
+    if (!scene.bvhNodes.empty()) {
+        mMemBvhNodes = clCreateBuffer(
+                mContext, CL_MEM_READ_ONLY, sizeof(BvhNode) * scene.bvhNodes.size(), nullptr, &err
+        );
+        checkClResult(err, "clCreateBuffer (bvhNodes)");
+
+        err = clEnqueueWriteBuffer(
+                mCommandQueue, mMemBvhNodes, CL_TRUE, 0,
+                sizeof(BvhNode) * scene.bvhNodes.size(),
+                scene.bvhNodes.data(), 0, nullptr, nullptr
+        );
+        checkClResult(err, "clEnqueueWriteBuffer (bvhNodes write)");
+
+        mMemBvhPrimIds = clCreateBuffer(
+                mContext, CL_MEM_READ_ONLY, sizeof(cl_uint) * scene.bvhPrimIds.size(), nullptr, &err
+        );
+        checkClResult(err, "clCreateBuffer (bvhPrimIds)");
+
+        err = clEnqueueWriteBuffer(
+                mCommandQueue, mMemBvhPrimIds, CL_TRUE, 0,
+                sizeof(cl_uint) * scene.bvhPrimIds.size(),
+                scene.bvhPrimIds.data(), 0, nullptr, nullptr
+        );
+        checkClResult(err, "clEnqueueWriteBuffer (bvhPrimIds write)");
+    }
+
+    uploadShadingTables(scene);
 }
 
 OpenClExecutor::~OpenClExecutor() {
+    for (size_t i = 0; i < CL_PIPELINE_DEPTH; i++) {
+        releaseWavefront(mWavefronts[i]);
+    }
+    cl_kernel *kernels[] = {
+            &mKrnFinishPixels, &mKrnCompactRays, &mKrnAddGroupOffsets, &mKrnScanGroups,
+            &mKrnReduceOcclusion, &mKrnAmbientOcclusionRays, &mKrnShadeHits
+    };
+    for (cl_kernel *kernel : kernels) {
+        if (*kernel != 0) {
+            clReleaseKernel(*kernel);
+            *kernel = 0;
+        }
+    }
+    if (mKrnCameraRays != 0) {
+        clReleaseKernel(mKrnCameraRays);
+        mKrnCameraRays = 0;
+    }
+    if (mKrnAnyHit != 0) {
+        clReleaseKernel(mKrnAnyHit);
+        mKrnAnyHit = 0;
+    }
+    if (mKrnClosestHit != 0) {
+        clReleaseKernel(mKrnClosestHit);
+        mKrnClosestHit = 0;
+    }
+    cl_mem shadingTables[] = {mMemLamps, mMemTexels, mMemTriangleUvs, mMemPrimMaterials, mMemMaterials};
+    for (cl_mem mem : shadingTables) {
+        if (mem != 0) {
+            clReleaseMemObject(mem);
+        }
+    }
+    mMemLamps = mMemTexels = mMemTriangleUvs = mMemPrimMaterials = mMemMaterials = 0;
+    if (mMemBvhPrimIds != 0) {
+        clReleaseMemObject(mMemBvhPrimIds);
+        mMemBvhPrimIds = 0;
+    }
+    if (mMemBvhNodes != 0) {
+        clReleaseMemObject(mMemBvhNodes);
+        mMemBvhNodes = 0;
+    }
     if (mMemSpheres != 0) {
         clReleaseMemObject(mMemSpheres);
         mMemSpheres = 0;
@@ -116,14 +297,6 @@ OpenClExecutor::~OpenClExecutor() {
         clReleaseMemObject(mMemTriangles);
         mMemTriangles = 00;
     }
-    if (mKrnHitSphere != 0) {
-        clReleaseKernel(mKrnHitSphere);
-        mKrnHitSphere = 0;
-    }
-    if (mKrnHitTriangle != 0) {
-        clReleaseKernel(mKrnHitTriangle);
-        mKrnHitTriangle = 0;
-    }
     if (mProgram != 0) {
         clReleaseProgram(mProgram);
         mProgram = 0;
@@ -146,379 +319,737 @@ OpenClExecutor::~OpenClExecutor() {
     }
 }
 
-void
-OpenClExecutor::computeClosestHitTriangle(
-        const cl_float *rays,
-        cl_uint rayCount,
-        std::vector<std::tuple<TriangleHit, size_t>> &resHits
+cl_event
+OpenClExecutor::enqueueRenderPixels(
+        cl_uint slot,
+        const glm::vec3 &camPos,
+        const glm::mat3 &camMat,
+        cl_uint width,
+        cl_uint height,
+        cl_uint firstPixel,
+        cl_uint pixelCount,
+        cl_float *resPixels
 ) {
     cl_int err;
 
-    resHits.clear();
-    resHits.resize(rayCount, std::make_tuple(TriangleHit(false), 0));
+    if (pixelCount == 0) {
+        return 0;
+    }
 
-    if (mTriangleCount == 0 || rayCount == 0) {
-        return;
+    ClWavefrontBuffers &wavefront = mWavefronts[slot];
+    cl_mem memRays[2];
+    cl_mem memPixelIds[2];
+    cl_mem memWeights[2];
+    for (int i = 0; i < 2; i++) {
+        memRays[i] = reserveBuffer(
+                wavefront.rays[i], sizeof(cl_float) * RAY_SIZE * pixelCount, "renderPixels (rays)"
+        );
+        memPixelIds[i] = reserveBuffer(
+                wavefront.pixelIds[i], sizeof(cl_uint) * pixelCount, "renderPixels (pixelIds)"
+        );
+        memWeights[i] = reserveBuffer(
+                wavefront.weights[i], sizeof(cl_float) * pixelCount, "renderPixels (weights)"
+        );
     }
 
-    cl_mem memRays = clCreateBuffer(
-            mContext, CL_MEM_READ_ONLY, sizeof(cl_float) * RAY_SIZE * rayCount, nullptr, &err
+    cl_mem memHits = reserveBuffer(
+            wavefront.hits, sizeof(ClHitRecord) * pixelCount, "renderPixels (hits)"
     );
-    checkClResult(err, "closestHitTriangle clCreateBuffer (memRays)");
 
-    cl_mem memTrianglesHits = clCreateBuffer(
-            mContext, CL_MEM_WRITE_ONLY, sizeof(cl_char) * mTriangleCount * rayCount, nullptr, &err
+    cl_mem memPixels = reserveBuffer(
+            wavefront.pixels, sizeof(cl_float) * 3 * pixelCount, "renderPixels (pixels)"
     );
-    checkClResult(err, "closestHitTriangle clCreateBuffer (hits)");
 
-    cl_mem memTrianglesHitParams = clCreateBuffer(
-            mContext, CL_MEM_WRITE_ONLY, sizeof(cl_float) * TRIANGLE_HIT_PARAM_SIZE * mTriangleCount * rayCount,
-            nullptr,
-            &err
+    cl_float zero = 0.0f;
+    err = clEnqueueFillBuffer(
+            mCommandQueue, memPixels, &zero, sizeof(zero), 0, sizeof(cl_float) * 3 * pixelCount, 0, nullptr, nullptr
     );
-    checkClResult(err, "closestHitTriangle clCreateBuffer (hitParams)");
+    checkClResult(err, "clEnqueueFillBuffer (renderPixels pixels)");
 
-    err = clEnqueueWriteBuffer(
-            mCommandQueue, memRays, CL_TRUE, 0, sizeof(cl_float) * RAY_SIZE * rayCount, rays, 0, nullptr, nullptr
-    );
-    checkClResult(err, "clEnqueueWriteBuffer (closestHit triangle rays)");
+    /* primary rays */
+    cl_float3 clCamPos = {{camPos.x, camPos.y, camPos.z, 0.0f}};
+    cl_float3 clCamAxes[3];
+    for (int i = 0; i < 3; i++) {
+        clCamAxes[i] = {{camMat[i].x, camMat[i].y, camMat[i].z, 0.0f}};
+    }
 
-    cl_uint triangleCount = (cl_uint) mTriangleCount;
-    clSetKernelArg(mKrnHitTriangle, 0, sizeof(cl_mem), &mMemTriangles);
-    clSetKernelArg(mKrnHitTriangle, 1, sizeof(cl_uint), &triangleCount);
-    clSetKernelArg(mKrnHitTriangle, 2, sizeof(cl_mem), &memRays);
-    clSetKernelArg(mKrnHitTriangle, 3, sizeof(cl_uint), &rayCount);
-    clSetKernelArg(mKrnHitTriangle, 4, sizeof(cl_mem), &memTrianglesHits);
-    clSetKernelArg(mKrnHitTriangle, 5, sizeof(cl_mem), &memTrianglesHitParams);
-
-    size_t dimensions[] = {mTriangleCount, rayCount};
+    cl_uint argIdx = 0;
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_float3), &clCamPos);
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_float3), &clCamAxes[0]);
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_float3), &clCamAxes[1]);
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_float3), &clCamAxes[2]);
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_uint), &width);
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_uint), &height);
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_uint), &firstPixel);
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_uint), &pixelCount);
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_mem), &memRays[0]);
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_mem), &memPixelIds[0]);
+    clSetKernelArg(mKrnCameraRays, argIdx++, sizeof(cl_mem), &memWeights[0]);
+
+    size_t pixelDimensions[] = {pixelCount};
     err = clEnqueueNDRangeKernel(
-            mCommandQueue, mKrnHitTriangle, 2, nullptr, dimensions, nullptr, 0, nullptr, nullptr
+            mCommandQueue, mKrnCameraRays, 1, nullptr, pixelDimensions, nullptr, 0, nullptr, nullptr
     );
-    checkClResult(err, "clEnqueueNDRangeKernel (closestHit triangles)");
+    checkClResult(err, "clEnqueueNDRangeKernel (cameraRays)");
+
+#ifdef ENABLE_REFLECTION
+    const int maxBounces = MAX_REFLECTION_DEPTH;
+#else
+    const int maxBounces = 0;
+#endif
+
+    cl_uint rayCount = pixelCount;
+    int current = 0;
+    for (int bounce = 0;; bounce++) {
+        size_t dimensions[] = {rayCount};
+
+        /* closest hits */
+        if (mTriangleCount == 0 && mSphereCount == 0) {
+            ClHitRecord noHit = {0.0f, 0.0f, 0.0f, -1};
+            err = clEnqueueFillBuffer(
+                    mCommandQueue, memHits, &noHit, sizeof(noHit), 0, sizeof(ClHitRecord) * rayCount,
+                    0, nullptr, nullptr
+            );
+            checkClResult(err, "clEnqueueFillBuffer (renderPixels hits)");
+        } else {
+            argIdx = setSceneArgs(mKrnClosestHit);
+            clSetKernelArg(mKrnClosestHit, argIdx++, sizeof(cl_mem), &memRays[current]);
+            clSetKernelArg(mKrnClosestHit, argIdx++, sizeof(cl_uint), &rayCount);
+            clSetKernelArg(mKrnClosestHit, argIdx++, sizeof(cl_mem), &memHits);
+
+            err = clEnqueueNDRangeKernel(
+                    mCommandQueue, mKrnClosestHit, 1, nullptr, dimensions, nullptr, 0, nullptr, nullptr
+            );
+            checkClResult(err, "clEnqueueNDRangeKernel (renderPixels closestHit)");
+        }
 
-    std::vector<cl_char> triangleHits(rayCount * mTriangleCount);
-    err = clEnqueueReadBuffer(
-            mCommandQueue, memTrianglesHits, CL_TRUE, 0,
-            sizeof(cl_char) * mTriangleCount * rayCount, triangleHits.data(), 0, nullptr, nullptr
-    );
-    checkClResult(err, "clEnqueueReadBuffer (closestHit triangles hit)");
+#ifdef ENABLE_AO
+        /* ambient occlusion: AO_RAYS_COUNT rays per hit, reduced to one factor per hit */
+        cl_mem memAoVisible = reserveBuffer(
+                wavefront.aoVisible, sizeof(cl_uchar) * AO_RAYS_COUNT * rayCount, "renderPixels (aoVisible)"
+        );
+        cl_mem memAoFactors = reserveBuffer(
+                wavefront.aoFactors, sizeof(cl_float) * rayCount, "renderPixels (aoFactors)"
+        );
 
-    std::vector<cl_float> triangleHitParams(TRIANGLE_HIT_PARAM_SIZE * rayCount * mTriangleCount);
-    err = clEnqueueReadBuffer(
-            mCommandQueue, memTrianglesHitParams, CL_TRUE, 0,
-            sizeof(cl_float) * TRIANGLE_HIT_PARAM_SIZE * mTriangleCount * rayCount, triangleHitParams.data(), 0,
-            nullptr,
-            nullptr
-    );
-    checkClResult(err, "clEnqueueReadBuffer (closestHit triangles hit params)");
+        cl_uint bounceIdx = (cl_uint) bounce;
+        argIdx = setSceneArgs(mKrnAmbientOcclusionRays);
+        clSetKernelArg(mKrnAmbientOcclusionRays, argIdx++, sizeof(cl_mem), &memRays[current]);
+        clSetKernelArg(mKrnAmbientOcclusionRays, argIdx++, sizeof(cl_mem), &memHits);
+        clSetKernelArg(mKrnAmbientOcclusionRays, argIdx++, sizeof(cl_mem), &memPixelIds[current]);
+        clSetKernelArg(mKrnAmbientOcclusionRays, argIdx++, sizeof(cl_uint), &firstPixel);
+        clSetKernelArg(mKrnAmbientOcclusionRays, argIdx++, sizeof(cl_uint), &bounceIdx);
+        clSetKernelArg(mKrnAmbientOcclusionRays, argIdx++, sizeof(cl_uint), &rayCount);
+        clSetKernelArg(mKrnAmbientOcclusionRays, argIdx++, sizeof(cl_mem), &memAoVisible);
+
+        size_t aoDimensions[] = {rayCount, AO_RAYS_COUNT};
+        err = clEnqueueNDRangeKernel(
+                mCommandQueue, mKrnAmbientOcclusionRays, 2, nullptr, aoDimensions, nullptr, 0, nullptr, nullptr
+        );
+        checkClResult(err, "clEnqueueNDRangeKernel (ambientOcclusionRays)");
 
+        argIdx = 0;
+        clSetKernelArg(mKrnReduceOcclusion, argIdx++, sizeof(cl_mem), &memAoVisible);
+        clSetKernelArg(mKrnReduceOcclusion, argIdx++, sizeof(cl_uint), &rayCount);
+        clSetKernelArg(mKrnReduceOcclusion, argIdx++, sizeof(cl_float), &mAmbientFactor);
+        clSetKernelArg(mKrnReduceOcclusion, argIdx++, sizeof(cl_mem), &memAoFactors);
 
-    for (size_t i = 0; i < rayCount; i++) {
-        glm::vec3 rayFrom(
-                rays[i * RAY_SIZE],
-                rays[i * RAY_SIZE + 1],
-                rays[i * RAY_SIZE + 2]
+        err = clEnqueueNDRangeKernel(
+                mCommandQueue, mKrnReduceOcclusion, 1, nullptr, dimensions, nullptr, 0, nullptr, nullptr
         );
+        checkClResult(err, "clEnqueueNDRangeKernel (reduceOcclusion)");
+#endif
+
+        /* shadow rays, shading and reflection candidates */
+        cl_uint spawnReflections = bounce < maxBounces ? 1 : 0;
+        cl_mem memBounceRays = 0;
+        cl_mem memBounceWeights = 0;
+        cl_mem memBounceFlags = 0;
+        if (spawnReflections) {
+            memBounceRays = reserveBuffer(
+                    wavefront.bounceRays, sizeof(cl_float) * RAY_SIZE * rayCount, "renderPixels (bounceRays)"
+            );
+            memBounceWeights = reserveBuffer(
+                    wavefront.bounceWeights, sizeof(cl_float) * rayCount, "renderPixels (bounceWeights)"
+            );
+            memBounceFlags = reserveBuffer(
+                    wavefront.bounceFlags, sizeof(cl_uint) * rayCount, "renderPixels (bounceFlags)"
+            );
+        }
 
-        glm::vec3 rayDir(
-                rays[i * RAY_SIZE + 3],
-                rays[i * RAY_SIZE + 4],
-                rays[i * RAY_SIZE + 5]
+        cl_uint lampCount = (cl_uint) mLampCount;
+        argIdx = setSceneArgs(mKrnShadeHits);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &mMemMaterials);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &mMemPrimMaterials);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &mMemTriangleUvs);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &mMemTexels);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &mMemLamps);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_uint), &lampCount);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_float3), &mHorizonColor);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &memRays[current]);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &memHits);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &memPixelIds[current]);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &memWeights[current]);
+#ifdef ENABLE_AO
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &memAoFactors);
+#endif
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_uint), &rayCount);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_uint), &spawnReflections);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &memPixels);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &memBounceRays);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &memBounceWeights);
+        clSetKernelArg(mKrnShadeHits, argIdx++, sizeof(cl_mem), &memBounceFlags);
+
+        err = clEnqueueNDRangeKernel(
+                mCommandQueue, mKrnShadeHits, 1, nullptr, dimensions, nullptr, 0, nullptr, nullptr
         );
+        checkClResult(err, "clEnqueueNDRangeKernel (shadeHits)");
 
-        bool retIsHit = false;
-        size_t retI = 0;
-        cl_float retT = 0.0f;
-        cl_float retU = 0.0f;
-        cl_float retV = 0.0f;
-        glm::vec3 retPt;
-        glm::vec3 retNorm;
-
-        cl_float *paramsForRay = triangleHitParams.data() + (i * mTriangleCount * TRIANGLE_HIT_PARAM_SIZE);
-        for (size_t j = 0; j < mTriangleCount; j++) {
-            cl_float *hitParams = paramsForRay + (j * TRIANGLE_HIT_PARAM_SIZE);
-            cl_float t = hitParams[0];
-            if (triangleHits[i * mTriangleCount + j] && (!retIsHit || t < retT)) {
-                retIsHit = true;
-                retT = t;
-                retU = hitParams[1];
-                retV = hitParams[2];
-                retPt.x = hitParams[3];
-                retPt.y = hitParams[4];
-                retPt.z = hitParams[5];
-                retNorm.x = hitParams[6];
-                retNorm.y = hitParams[7];
-                retNorm.z = hitParams[8];
-                retI = j;
-            }
+        if (!spawnReflections) {
+            break;
         }
-        if (retIsHit) {
-            resHits[i] = std::make_tuple(TriangleHit(true, retT, retU, retV, retPt, retNorm), retI);
+
+        /* compaction of the reflected rays into the next wavefront */
+        cl_mem memBounceOffsets = reserveBuffer(
+                wavefront.bounceOffsets, sizeof(cl_uint) * rayCount, "renderPixels (bounceOffsets)"
+        );
+        cl_mem memBounceCount = reserveBuffer(
+                wavefront.bounceCount, sizeof(cl_uint), "renderPixels (bounceCount)"
+        );
+        enqueueExclusiveScan(wavefront, memBounceFlags, memBounceOffsets, rayCount, 0);
+
+        int next = 1 - current;
+        argIdx = 0;
+        clSetKernelArg(mKrnCompactRays, argIdx++, sizeof(cl_mem), &memBounceFlags);
+        clSetKernelArg(mKrnCompactRays, argIdx++, sizeof(cl_mem), &memBounceOffsets);
+        clSetKernelArg(mKrnCompactRays, argIdx++, sizeof(cl_uint), &rayCount);
+        clSetKernelArg(mKrnCompactRays, argIdx++, sizeof(cl_mem), &memBounceRays);
+        clSetKernelArg(mKrnCompactRays, argIdx++, sizeof(cl_mem), &memPixelIds[current]);
+        clSetKernelArg(mKrnCompactRays, argIdx++, sizeof(cl_mem), &memBounceWeights);
+        clSetKernelArg(mKrnCompactRays, argIdx++, sizeof(cl_mem), &memRays[next]);
+        clSetKernelArg(mKrnCompactRays, argIdx++, sizeof(cl_mem), &memPixelIds[next]);
+        clSetKernelArg(mKrnCompactRays, argIdx++, sizeof(cl_mem), &memWeights[next]);
+        clSetKernelArg(mKrnCompactRays, argIdx++, sizeof(cl_mem), &memBounceCount);
+
+        err = clEnqueueNDRangeKernel(
+                mCommandQueue, mKrnCompactRays, 1, nullptr, dimensions, nullptr, 0, nullptr, nullptr
+        );
+        checkClResult(err, "clEnqueueNDRangeKernel (compactRays)");
+
+        err = clEnqueueReadBuffer(
+                mCommandQueue, memBounceCount, CL_TRUE, 0, sizeof(cl_uint), &rayCount, 0, nullptr, nullptr
+        );
+        checkClResult(err, "clEnqueueReadBuffer (bounceCount)");
+        if (rayCount == 0) {
+            break;
         }
+        current = next;
     }
 
-    clReleaseMemObject(memRays);
-    clReleaseMemObject(memTrianglesHits);
-    clReleaseMemObject(memTrianglesHitParams);
+    /* gamma */
+    argIdx = 0;
+    clSetKernelArg(mKrnFinishPixels, argIdx++, sizeof(cl_mem), &memPixels);
+    clSetKernelArg(mKrnFinishPixels, argIdx++, sizeof(cl_uint), &pixelCount);
+
+    err = clEnqueueNDRangeKernel(
+            mCommandQueue, mKrnFinishPixels, 1, nullptr, pixelDimensions, nullptr, 0, nullptr, nullptr
+    );
+    checkClResult(err, "clEnqueueNDRangeKernel (finishPixels)");
+
+    cl_event event;
+    err = clEnqueueReadBuffer(
+            mCommandQueue, memPixels, CL_FALSE, 0, sizeof(cl_float) * 3 * pixelCount, resPixels, 0, nullptr, &event
+    );
+    checkClResult(err, "clEnqueueReadBuffer (renderPixels pixels)");
+
+    err = clFlush(mCommandQueue);
+    checkClResult(err, "clFlush (renderPixels)");
+    return event;
 }
 
-void OpenClExecutor::computeAnyHitTriangle(
-        const cl_float *rays,
-        cl_uint rayCount,
-        cl_char *resHits
+void
+OpenClExecutor::enqueueExclusiveScan(
+        ClWavefrontBuffers &wavefront,
+        cl_mem values,
+        cl_mem result,
+        cl_uint count,
+        size_t level
 ) {
     cl_int err;
 
-    if (mTriangleCount == 0 || rayCount == 0) {
-        return;
+    if (wavefront.scanSums.size() <= level) {
+        wavefront.scanSums.resize(level + 1);
+        wavefront.scanOffsets.resize(level + 1);
     }
 
-    cl_mem memRays = clCreateBuffer(
-            mContext, CL_MEM_READ_ONLY, sizeof(cl_float) * RAY_SIZE * rayCount, nullptr, &err
+    cl_uint groupCount = (cl_uint) ((count + mScanGroupSize - 1) / mScanGroupSize);
+    cl_mem memSums = reserveBuffer(
+            wavefront.scanSums[level], sizeof(cl_uint) * groupCount, "exclusiveScan (sums)"
     );
-    checkClResult(err, "anyHitTriangle clCreateBuffer (memRays)");
 
-    cl_mem memTrianglesHits = clCreateBuffer(
-            mContext, CL_MEM_WRITE_ONLY, sizeof(cl_char) * mTriangleCount * rayCount, nullptr, &err
-    );
-    checkClResult(err, "anyHitTriangle clCreateBuffer (hits)");
+    cl_uint argIdx = 0;
+    clSetKernelArg(mKrnScanGroups, argIdx++, sizeof(cl_mem), &values);
+    clSetKernelArg(mKrnScanGroups, argIdx++, sizeof(cl_uint), &count);
+    clSetKernelArg(mKrnScanGroups, argIdx++, sizeof(cl_mem), &result);
+    clSetKernelArg(mKrnScanGroups, argIdx++, sizeof(cl_mem), &memSums);
+    clSetKernelArg(mKrnScanGroups, argIdx++, sizeof(cl_uint) * mScanGroupSize, nullptr);
 
-    cl_mem memTrianglesHitParams = clCreateBuffer(
-            mContext, CL_MEM_WRITE_ONLY, sizeof(cl_float) * TRIANGLE_HIT_PARAM_SIZE * mTriangleCount * rayCount,
-            nullptr,
-            &err
+    size_t dimensions[] = {groupCount * mScanGroupSize};
+    size_t groupDimensions[] = {mScanGroupSize};
+    err = clEnqueueNDRangeKernel(
+            mCommandQueue, mKrnScanGroups, 1, nullptr, dimensions, groupDimensions, 0, nullptr, nullptr
     );
-    checkClResult(err, "anyHitTriangle clCreateBuffer (hitParams)");
+    checkClResult(err, "clEnqueueNDRangeKernel (scanGroups)");
+
+    if (groupCount == 1) {
+        return;
+    }
 
-    err = clEnqueueWriteBuffer(
-            mCommandQueue, memRays, CL_TRUE, 0, sizeof(cl_float) * RAY_SIZE * rayCount, rays, 0, nullptr, nullptr
+    cl_mem memOffsets = reserveBuffer(
+            wavefront.scanOffsets[level], sizeof(cl_uint) * groupCount, "exclusiveScan (offsets)"
     );
-    checkClResult(err, "clEnqueueWriteBuffer (anyHit triangle rays)");
+    enqueueExclusiveScan(wavefront, memSums, memOffsets, groupCount, level + 1);
+
+    argIdx = 0;
+    clSetKernelArg(mKrnAddGroupOffsets, argIdx++, sizeof(cl_mem), &result);
+    clSetKernelArg(mKrnAddGroupOffsets, argIdx++, sizeof(cl_uint), &count);
+    clSetKernelArg(mKrnAddGroupOffsets, argIdx++, sizeof(cl_mem), &memOffsets);
 
-    cl_uint triangleCount = (cl_uint) mTriangleCount;
-    clSetKernelArg(mKrnHitTriangle, 0, sizeof(cl_mem), &mMemTriangles);
-    clSetKernelArg(mKrnHitTriangle, 1, sizeof(cl_uint), &triangleCount);
-    clSetKernelArg(mKrnHitTriangle, 2, sizeof(cl_mem), &memRays);
-    clSetKernelArg(mKrnHitTriangle, 3, sizeof(cl_uint), &rayCount);
-    clSetKernelArg(mKrnHitTriangle, 4, sizeof(cl_mem), &memTrianglesHits);
-    clSetKernelArg(mKrnHitTriangle, 5, sizeof(cl_mem), &memTrianglesHitParams);
-
-    size_t dimensions[] = {mTriangleCount, rayCount};
     err = clEnqueueNDRangeKernel(
-            mCommandQueue, mKrnHitTriangle, 2, nullptr, dimensions, nullptr, 0, nullptr, nullptr
+            mCommandQueue, mKrnAddGroupOffsets, 1, nullptr, dimensions, groupDimensions, 0, nullptr, nullptr
     );
-    checkClResult(err, "clEnqueueNDRangeKernel (anyHit triangles)");
+    checkClResult(err, "clEnqueueNDRangeKernel (addGroupOffsets)");
+}
 
-    std::vector<cl_char> triangleHits(rayCount * mTriangleCount);
-    err = clEnqueueReadBuffer(
-            mCommandQueue, memTrianglesHits, CL_TRUE, 0,
-            sizeof(cl_char) * mTriangleCount * rayCount, triangleHits.data(), 0, nullptr, nullptr
-    );
-    checkClResult(err, "clEnqueueReadBuffer (anyHit triangles hit)");
+void
+OpenClExecutor::waitForEvent(
+        cl_event event
+) {
+    if (event == 0) {
+        return;
+    }
 
-    for (size_t i = 0; i < rayCount; i++) {
-        bool hits = false;
+    cl_int err = clWaitForEvents(1, &event);
+    clReleaseEvent(event);
+    checkClResult(err, "clWaitForEvents");
+}
 
-        for (size_t j = 0; j < mTriangleCount; j++) {
-            if (hits) {
-                break;
-            }
+cl_uint
+OpenClExecutor::setSceneArgs(
+        cl_kernel kernel
+) {
+    cl_uint triangleCount = (cl_uint) mTriangleCount;
+    cl_uint sphereCount = (cl_uint) mSphereCount;
+    cl_uint argIdx = 0;
+    clSetKernelArg(kernel, argIdx++, sizeof(cl_mem), &mMemTriangles);
+    clSetKernelArg(kernel, argIdx++, sizeof(cl_uint), &triangleCount);
+    clSetKernelArg(kernel, argIdx++, sizeof(cl_mem), &mMemSpheres);
+    clSetKernelArg(kernel, argIdx++, sizeof(cl_uint), &sphereCount);
+#ifdef ENABLE_BVH
+    clSetKernelArg(kernel, argIdx++, sizeof(cl_mem), &mMemBvhNodes);
+    clSetKernelArg(kernel, argIdx++, sizeof(cl_mem), &mMemBvhPrimIds);
+#endif
+    return argIdx;
+}
+
+cl_program
+OpenClExecutor::buildProgram(
+        cl_device_id deviceId,
+        const std::string &source,
+        const std::string &options
+) {
+    cl_int err;
+    cl_program program;
+
+    /* the driver may change its compiler without changing the device, so both are part of the key */
+    std::string cacheDir = binaryCacheDir();
+    std::string cachePath;
+    if (!cacheDir.empty()) {
+        uint64_t key = fnv1a(deviceInfoString(deviceId, CL_DEVICE_NAME));
+        key = fnv1a(deviceInfoString(deviceId, CL_DEVICE_VERSION), key);
+        key = fnv1a(deviceInfoString(deviceId, CL_DRIVER_VERSION), key);
+        key = fnv1a(options, key);
+        key = fnv1a(source, key);
+        std::ostringstream name;
+        name << cacheDir << "/cl_" << std::hex << key << ".bin";
+        cachePath = name.str();
+    }
 
-            if (triangleHits[i * mTriangleCount + j]) {
-                hits = true;
+    if (!cachePath.empty()) {
+        std::ifstream cacheFile(cachePath, std::ios::binary);
+        std::string binary((std::istreambuf_iterator<char>(cacheFile)), std::istreambuf_iterator<char>());
+        if (!binary.empty()) {
+            size_t binarySize = binary.size();
+            const unsigned char *binaryRaw = reinterpret_cast<const unsigned char *>(binary.data());
+            cl_int binaryStatus;
+            program = clCreateProgramWithBinary(mContext, 1, &deviceId, &binarySize, &binaryRaw, &binaryStatus, &err);
+            if (err == CL_SUCCESS && binaryStatus == CL_SUCCESS) {
+                if (clBuildProgram(program, 1, &deviceId, options.c_str(), nullptr, nullptr) == CL_SUCCESS) {
+                    return program;
+                }
+            }
+            /* stale or corrupted cache entry, fall back to the source and overwrite it */
+            if (err == CL_SUCCESS) {
+                clReleaseProgram(program);
             }
         }
+    }
+
+    const char *sourceRaw = source.data();
+    size_t sourceLength = source.size();
+    program = clCreateProgramWithSource(mContext, 1, &sourceRaw, &sourceLength, &err);
+    checkClResult(err, "clCreateProgramWithSource");
 
-        resHits[i] = hits;
+    err = clBuildProgram(program, 1, &deviceId, options.c_str(), nullptr, nullptr);
+    if (err != CL_SUCCESS) {
+        size_t logSize = 0;
+        clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
+        std::vector<char> log(logSize + 1, '\0');
+        clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG, logSize, log.data(), nullptr);
+        std::cerr << log.data() << std::endl;
+        clReleaseProgram(program);
     }
+    checkClResult(err, "clBuildProgram");
 
-    clReleaseMemObject(memRays);
-    clReleaseMemObject(memTrianglesHits);
-    clReleaseMemObject(memTrianglesHitParams);
+    if (!cachePath.empty()) {
+        size_t binarySize = 0;
+        err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binarySize), &binarySize, nullptr);
+        if (err == CL_SUCCESS && binarySize > 0) {
+            std::vector<unsigned char> binary(binarySize);
+            unsigned char *binaryRaw = binary.data();
+            err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaryRaw), &binaryRaw, nullptr);
+            if (err == CL_SUCCESS) {
+                /*
+                  written aside and renamed, so a concurrent reader never sees half of a binary.
+                  The temp name is unique per process and build, writers never share a temp file
+                */
+                static std::atomic<unsigned int> tmpCounter(0);
+                makeDirs(cacheDir);
+                std::string tmpPath = cachePath + ".tmp" + std::to_string(getpid())
+                                      + "_" + std::to_string(tmpCounter++);
+                std::ofstream cacheFile(tmpPath, std::ios::binary);
+                cacheFile.write(reinterpret_cast<const char *>(binary.data()), binary.size());
+                cacheFile.close();
+                if (!cacheFile || std::rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+                    std::remove(tmpPath.c_str());
+                }
+            }
+        }
+    }
+
+    return program;
 }
 
 void
-OpenClExecutor::computeClosestHitSphere(
-        const cl_float *rays,
-        cl_uint rayCount,
-        std::vector<std::tuple<SphereHit, size_t>> &resHits
+OpenClExecutor::uploadShadingTables(
+        const Scene &scene
 ) {
-    cl_int err;
-
-    resHits.clear();
-    resHits.resize(rayCount, std::make_tuple(SphereHit(false), 0));
+    std::vector<ClMaterial> materials;
+    std::vector<cl_uchar> texels;
+    materials.reserve(scene.materials.size());
+    for (const Material &material : scene.materials) {
+        ClMaterial clMaterial;
+        clMaterial.color[0] = material.color.r;
+        clMaterial.color[1] = material.color.g;
+        clMaterial.color[2] = material.color.b;
+        clMaterial.diffusiveFactor = material.diffusiveFactor;
+        clMaterial.specularFactor = material.specularFactor;
+        clMaterial.specularHardness = material.specularHardness;
+        clMaterial.reflectionFactor = material.reflectionFactor;
+        clMaterial.texOffset = -1;
+        clMaterial.texWidth = 0;
+        clMaterial.texHeight = 0;
+        clMaterial.texSize = 0;
+        if (material.textured && material.texImage) {
+            const std::vector<unsigned char> &data = *material.texImage->getRawData();
+            clMaterial.texOffset = (cl_int) texels.size();
+            clMaterial.texWidth = material.texImage->getWidth();
+            clMaterial.texHeight = material.texImage->getHeight();
+            clMaterial.texSize = (cl_uint) data.size();
+            texels.insert(texels.end(), data.begin(), data.end());
+        }
+        materials.push_back(clMaterial);
+    }
 
-    if (mSphereCount == 0 || rayCount == 0) {
-        return;
+    /* material ids of the scene index the uploaded table as they are */
+    std::vector<cl_uint> primMaterials;
+    primMaterials.reserve(mTriangleCount + mSphereCount);
+    primMaterials.insert(primMaterials.end(), scene.triangles.materialIds.begin(), scene.triangles.materialIds.end());
+    primMaterials.insert(primMaterials.end(), scene.spheres.materialIds.begin(), scene.spheres.materialIds.end());
+
+    std::vector<cl_float> triangleUvs(mTriangleCount * UV_SIZE);
+    for (size_t i = 0; i < mTriangleCount; i++) {
+        cl_float *dst = triangleUvs.data() + i * UV_SIZE;
+        dst[0] = scene.triangles.uvStarts[i].x;
+        dst[1] = scene.triangles.uvStarts[i].y;
+        dst[2] = scene.triangles.uvUs[i].x;
+        dst[3] = scene.triangles.uvUs[i].y;
+        dst[4] = scene.triangles.uvVs[i].x;
+        dst[5] = scene.triangles.uvVs[i].y;
     }
 
-    cl_mem memRays = clCreateBuffer(
-            mContext, CL_MEM_READ_ONLY, sizeof(cl_float) * RAY_SIZE * rayCount, nullptr, &err
-    );
-    checkClResult(err, "closestHitSphere clCreateBuffer (memRays)");
+    mLampCount = scene.lamps.size();
+    std::vector<cl_float> lamps(mLampCount * LAMP_SIZE);
+    for (size_t i = 0; i < mLampCount; i++) {
+        const Lamp &lamp = *scene.lamps[i];
+        cl_float *dst = lamps.data() + i * LAMP_SIZE;
+        dst[0] = lamp.pos.x;
+        dst[1] = lamp.pos.y;
+        dst[2] = lamp.pos.z;
+        dst[3] = lamp.intensity;
+        dst[4] = lamp.distance;
+    }
 
-    cl_mem memSpheresHits = clCreateBuffer(
-            mContext, CL_MEM_WRITE_ONLY, sizeof(cl_char) * mSphereCount * rayCount, nullptr, &err
-    );
-    checkClResult(err, "closestHitSphere clCreateBuffer (hits)");
+    mHorizonColor = {{scene.worldHorizonColor.r, scene.worldHorizonColor.g, scene.worldHorizonColor.b, 0.0f}};
+    mAmbientFactor = scene.worldAmbientFactor;
 
-    cl_mem memSpheresHitParams = clCreateBuffer(
-            mContext, CL_MEM_WRITE_ONLY, sizeof(cl_float) * SPHERE_HIT_PARAM_SIZE * mSphereCount * rayCount, nullptr,
-            &err
+    static_assert(sizeof(ClMaterial) == 11 * sizeof(cl_float), "ClMaterial must match the device layout");
+    mMemMaterials = createConstBuffer(
+            sizeof(ClMaterial) * materials.size(), materials.data(), "clCreateBuffer (materials)"
     );
-    checkClResult(err, "closestHitSphere clCreateBuffer (hitParams)");
-
-    err = clEnqueueWriteBuffer(
-            mCommandQueue, memRays, CL_TRUE, 0, sizeof(cl_float) * RAY_SIZE * rayCount, rays, 0, nullptr, nullptr
+    mMemPrimMaterials = createConstBuffer(
+            sizeof(cl_uint) * primMaterials.size(), primMaterials.data(), "clCreateBuffer (primMaterials)"
     );
-    checkClResult(err, "clEnqueueWriteBuffer (closestHit spheres rays)");
-
-    cl_uint sphereCount = (cl_uint) mSphereCount;
-    clSetKernelArg(mKrnHitSphere, 0, sizeof(cl_mem), &mMemSpheres);
-    clSetKernelArg(mKrnHitSphere, 1, sizeof(cl_uint), &sphereCount);
-    clSetKernelArg(mKrnHitSphere, 2, sizeof(cl_mem), &memRays);
-    clSetKernelArg(mKrnHitSphere, 3, sizeof(cl_uint), &rayCount);
-    clSetKernelArg(mKrnHitSphere, 4, sizeof(cl_mem), &memSpheresHits);
-    clSetKernelArg(mKrnHitSphere, 5, sizeof(cl_mem), &memSpheresHitParams);
-
-    size_t dimensions[] = {mSphereCount, rayCount};
-    err = clEnqueueNDRangeKernel(
-            mCommandQueue, mKrnHitSphere, 2, nullptr, dimensions, nullptr, 0, nullptr, nullptr
+    mMemTriangleUvs = createConstBuffer(
+            sizeof(cl_float) * triangleUvs.size(), triangleUvs.data(), "clCreateBuffer (triangleUvs)"
     );
-    checkClResult(err, "clEnqueueNDRangeKernel (closestHit spheres)");
-
-    std::vector<cl_char> sphereHits(rayCount * mSphereCount);
-    err = clEnqueueReadBuffer(
-            mCommandQueue, memSpheresHits, CL_TRUE, 0,
-            sizeof(cl_char) * mSphereCount * rayCount, sphereHits.data(), 0, nullptr, nullptr
+    mMemTexels = createConstBuffer(
+            sizeof(cl_uchar) * texels.size(), texels.data(), "clCreateBuffer (texels)"
     );
-    checkClResult(err, "clEnqueueReadBuffer (closestHit spheres hit)");
-
-    std::vector<cl_float> sphereHitParams(SPHERE_HIT_PARAM_SIZE * rayCount * mSphereCount);
-    err = clEnqueueReadBuffer(
-            mCommandQueue, memSpheresHitParams, CL_TRUE, 0,
-            sizeof(cl_float) * SPHERE_HIT_PARAM_SIZE * mSphereCount * rayCount, sphereHitParams.data(), 0, nullptr,
-            nullptr
+    mMemLamps = createConstBuffer(
+            sizeof(cl_float) * lamps.size(), lamps.data(), "clCreateBuffer (lamps)"
     );
-    checkClResult(err, "clEnqueueReadBuffer (closestHit spheres hit params)");
+}
 
-    for (size_t i = 0; i < rayCount; i++) {
-        glm::vec3 rayFrom(
-                rays[i * RAY_SIZE],
-                rays[i * RAY_SIZE + 1],
-                rays[i * RAY_SIZE + 2]
-        );
+cl_mem
+OpenClExecutor::createConstBuffer(
+        size_t size,
+        const void *data,
+        const char *msg
+) {
+    if (size == 0) {
+        return 0;
+    }
 
-        glm::vec3 rayDir(
-                rays[i * RAY_SIZE + 3],
-                rays[i * RAY_SIZE + 4],
-                rays[i * RAY_SIZE + 5]
-        );
+    cl_int err;
+    cl_mem mem = clCreateBuffer(
+            mContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, const_cast<void *>(data), &err
+    );
+    checkClResult(err, msg);
+    return mem;
+}
 
-        bool retIsHit = false;
-        size_t retI = 0;
-        cl_float retT = 0.0f;
-        glm::vec3 retPt;
-        glm::vec3 retNorm;
-
-        cl_float *paramsForRay = sphereHitParams.data() + (i * mSphereCount * SPHERE_HIT_PARAM_SIZE);
-        for (size_t j = 0; j < mSphereCount; j++) {
-            cl_float *hitParams = paramsForRay + (j * SPHERE_HIT_PARAM_SIZE);
-            cl_float t = hitParams[0];
-            if (sphereHits[i * mSphereCount + j] && (!retIsHit || t < retT)) {
-                retIsHit = true;
-                retT = t;
-                retI = j;
-                retPt.x = hitParams[1];
-                retPt.y = hitParams[2];
-                retPt.z = hitParams[3];
-                retNorm.x = hitParams[4];
-                retNorm.y = hitParams[5];
-                retNorm.z = hitParams[6];
-            }
-        }
-        if (retIsHit) {
-            resHits[i] = std::make_tuple(SphereHit(true, retT, retPt, retNorm), retI);
-        }
+cl_mem
+OpenClExecutor::reserveBuffer(
+        ClBuffer &buffer,
+        size_t size,
+        const char *msg
+) {
+    if (buffer.mem != 0 && buffer.size >= size) {
+        return buffer.mem;
     }
 
-    clReleaseMemObject(memRays);
-    clReleaseMemObject(memSpheresHits);
-    clReleaseMemObject(memSpheresHitParams);
+    releaseBuffer(buffer);
+
+    cl_int err;
+    buffer.mem = clCreateBuffer(mContext, CL_MEM_READ_WRITE, size, nullptr, &err);
+    checkClResult(err, msg);
+    buffer.size = size;
+    return buffer.mem;
 }
 
 void
-OpenClExecutor::computeAnyHitSphere(
-        const cl_float *rays,
-        cl_uint rayCount,
-        cl_char *resHits
+OpenClExecutor::releaseWavefront(
+        ClWavefrontBuffers &wavefront
 ) {
-    cl_int err;
+    for (int i = 0; i < 2; i++) {
+        releaseBuffer(wavefront.rays[i]);
+        releaseBuffer(wavefront.pixelIds[i]);
+        releaseBuffer(wavefront.weights[i]);
+    }
+    releaseBuffer(wavefront.hits);
+    releaseBuffer(wavefront.pixels);
+    releaseBuffer(wavefront.bounceRays);
+    releaseBuffer(wavefront.bounceWeights);
+    releaseBuffer(wavefront.bounceFlags);
+    releaseBuffer(wavefront.bounceOffsets);
+    releaseBuffer(wavefront.bounceCount);
+    releaseBuffer(wavefront.aoVisible);
+    releaseBuffer(wavefront.aoFactors);
+    for (auto &buffer : wavefront.scanSums) {
+        releaseBuffer(buffer);
+    }
+    for (auto &buffer : wavefront.scanOffsets) {
+        releaseBuffer(buffer);
+    }
+}
 
-    if (mSphereCount == 0 || rayCount == 0) {
-        return;
+void
+OpenClExecutor::releaseBuffer(
+        ClBuffer &buffer
+) {
+    if (buffer.mem != 0) {
+        clReleaseMemObject(buffer.mem);
+        buffer.mem = 0;
+        buffer.size = 0;
     }
+}
 
-    cl_mem memRays = clCreateBuffer(
-            mContext, CL_MEM_READ_ONLY, sizeof(cl_float) * RAY_SIZE * rayCount, nullptr, &err
-    );
-    checkClResult(err, "closestHitSphere clCreateBuffer (memRays)");
 
-    cl_mem memSpheresHits = clCreateBuffer(
-            mContext, CL_MEM_WRITE_ONLY, sizeof(cl_char) * mSphereCount * rayCount, nullptr, &err
-    );
-    checkClResult(err, "closestHitSphere clCreateBuffer (hits)");
+static std::string
+toLower(
+        std::string str
+) {
+    std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+    return str;
+}
 
-    cl_mem memSpheresHitParams = clCreateBuffer(
-            mContext, CL_MEM_WRITE_ONLY, sizeof(cl_float) * SPHERE_HIT_PARAM_SIZE * mSphereCount * rayCount, nullptr,
-            &err
-    );
-    checkClResult(err, "closestHitSphere clCreateBuffer (hitParams)");
 
-    err = clEnqueueWriteBuffer(
-            mCommandQueue, memRays, CL_TRUE, 0, sizeof(cl_float) * RAY_SIZE * rayCount, rays, 0, nullptr, nullptr
-    );
-    checkClResult(err, "clEnqueueWriteBuffer (closestHit spheres rays)");
+static void
+addClDevice(
+        std::vector<cl_device_id> &devices,
+        cl_device_id deviceId,
+        cl_uint subDeviceUnits
+) {
+    if (subDeviceUnits > 0) {
+        cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_EQUALLY, subDeviceUnits, 0};
+        cl_uint subDeviceCount = 0;
+        if (clCreateSubDevices(deviceId, properties, 0, nullptr, &subDeviceCount) == CL_SUCCESS &&
+            subDeviceCount > 0) {
+            std::vector<cl_device_id> subDevices(subDeviceCount);
+            if (clCreateSubDevices(deviceId, properties, subDeviceCount, subDevices.data(), nullptr) == CL_SUCCESS) {
+                devices.insert(devices.end(), subDevices.begin(), subDevices.end());
+                return;
+            }
+        }
+        std::cerr << "can't split " << deviceInfoString(deviceId, CL_DEVICE_NAME) << " into sub-devices" << std::endl;
+    }
 
-    cl_uint sphereCount = (cl_uint) mSphereCount;
-    clSetKernelArg(mKrnHitSphere, 0, sizeof(cl_mem), &mMemSpheres);
-    clSetKernelArg(mKrnHitSphere, 1, sizeof(cl_uint), &sphereCount);
-    clSetKernelArg(mKrnHitSphere, 2, sizeof(cl_mem), &memRays);
-    clSetKernelArg(mKrnHitSphere, 3, sizeof(cl_uint), &rayCount);
-    clSetKernelArg(mKrnHitSphere, 4, sizeof(cl_mem), &memSpheresHits);
-    clSetKernelArg(mKrnHitSphere, 5, sizeof(cl_mem), &memSpheresHitParams);
-
-    size_t dimensions[] = {mSphereCount, rayCount};
-    err = clEnqueueNDRangeKernel(
-            mCommandQueue, mKrnHitSphere, 2, nullptr, dimensions, nullptr, 0, nullptr, nullptr
-    );
-    checkClResult(err, "clEnqueueNDRangeKernel (closestHit spheres)");
+    devices.push_back(deviceId);
+}
+
+
+/**
+  Records that the spec selects deviceId, split into sub-devices of subDeviceUnits compute units if it is nonzero.
+  A device is used once: sub-devices replace the whole device, and the first split asked for wins,
+  so no two executors ever share compute units
+*/
+static void
+selectClDevice(
+        std::vector<std::pair<cl_device_id, cl_uint>> &selected,
+        cl_device_id deviceId,
+        cl_uint subDeviceUnits
+) {
+    for (auto &choice : selected) {
+        if (choice.first == deviceId) {
+            if (choice.second == 0) {
+                choice.second = subDeviceUnits;
+            }
+            return;
+        }
+    }
+    selected.push_back(std::make_pair(deviceId, subDeviceUnits));
+}
 
-    std::vector<cl_char> sphereHits(rayCount * mSphereCount);
-    err = clEnqueueReadBuffer(
-            mCommandQueue, memSpheresHits, CL_TRUE, 0,
-            sizeof(cl_char) * mSphereCount * rayCount, sphereHits.data(), 0, nullptr, nullptr
-    );
-    checkClResult(err, "clEnqueueReadBuffer (closestHit spheres hit)");
 
-    for (size_t i = 0; i < rayCount; i++) {
-        bool hits = false;
+std::vector<cl_device_id>
+selectClDevices(
+        const std::string &spec
+) {
+    std::vector<cl_device_id> allDevices;
+    cl_uint platformCount = 0;
+    if (clGetPlatformIDs(0, nullptr, &platformCount) == CL_SUCCESS && platformCount > 0) {
+        std::vector<cl_platform_id> platformIds(platformCount);
+        clGetPlatformIDs(platformCount, platformIds.data(), nullptr);
+        for (cl_platform_id platformId : platformIds) {
+            cl_uint deviceCount = 0;
+            if (clGetDeviceIDs(platformId, CL_DEVICE_TYPE_ALL, 0, nullptr, &deviceCount) != CL_SUCCESS) {
+                continue;
+            }
+            std::vector<cl_device_id> deviceIds(deviceCount);
+            clGetDeviceIDs(platformId, CL_DEVICE_TYPE_ALL, deviceCount, deviceIds.data(), nullptr);
+            allDevices.insert(allDevices.end(), deviceIds.begin(), deviceIds.end());
+        }
+    }
+    if (allDevices.empty()) {
+        throw std::runtime_error("no OpenCL devices");
+    }
+
+    std::vector<std::pair<cl_device_id, cl_uint>> selected;
+    std::stringstream entries(spec);
+    std::string entry;
+    while (std::getline(entries, entry, ',')) {
+        cl_uint subDeviceUnits = 0;
+        size_t slash = entry.find('/');
+        if (slash != std::string::npos) {
+            subDeviceUnits = (cl_uint) std::strtoul(entry.c_str() + slash + 1, nullptr, 10);
+            entry = entry.substr(0, slash);
+        }
+        entry = toLower(entry);
+        if (entry.empty()) {
+            continue;
+        }
 
-        for (size_t j = 0; j < mSphereCount; j++) {
-            if (hits) {
-                break;
+        if (entry.find_first_not_of("0123456789") == std::string::npos) {
+            size_t idx = std::strtoul(entry.c_str(), nullptr, 10);
+            if (idx < allDevices.size()) {
+                selectClDevice(selected, allDevices[idx], subDeviceUnits);
             }
+            continue;
+        }
 
-            if (sphereHits[i * mSphereCount + j]) {
-                hits = true;
+        for (cl_device_id deviceId : allDevices) {
+            cl_device_type type = 0;
+            clGetDeviceInfo(deviceId, CL_DEVICE_TYPE, sizeof(type), &type, nullptr);
+            bool matches;
+            if (entry == "all") {
+                matches = true;
+            } else if (entry == "gpu") {
+                matches = (type & CL_DEVICE_TYPE_GPU) != 0;
+            } else if (entry == "cpu") {
+                matches = (type & CL_DEVICE_TYPE_CPU) != 0;
+            } else if (entry == "accelerator") {
+                matches = (type & CL_DEVICE_TYPE_ACCELERATOR) != 0;
+            } else {
+                matches = toLower(deviceInfoString(deviceId, CL_DEVICE_NAME)).find(entry) != std::string::npos;
+            }
+            if (matches) {
+                selectClDevice(selected, deviceId, subDeviceUnits);
             }
         }
+    }
 
-        resHits[i] = hits;
+    std::vector<cl_device_id> devices;
+    for (auto &choice : selected) {
+        addClDevice(devices, choice.first, choice.second);
     }
+    if (devices.empty()) {
+        std::cerr << "no OpenCL device matches \"" << spec << "\", using "
+                  << deviceInfoString(allDevices[0], CL_DEVICE_NAME) << std::endl;
+        devices.push_back(allDevices[0]);
+    }
+    return devices;
+}
+
 
-    clReleaseMemObject(memRays);
-    clReleaseMemObject(memSpheresHits);
-    clReleaseMemObject(memSpheresHitParams);
+OpenClMultiExecutor::OpenClMultiExecutor(
+        const Scene &scene,
+        const std::string &deviceSpec
+) {
+    std::vector<cl_device_id> devices = selectClDevices(deviceSpec);
+    try {
+        for (cl_device_id deviceId : devices) {
+            mExecutors.push_back(std::shared_ptr<OpenClExecutor>(new OpenClExecutor(scene, deviceId)));
+        }
+    } catch (...) {
+        for (cl_device_id deviceId : devices) {
+            clReleaseDevice(deviceId);
+        }
+        throw;
+    }
+
+    /* contexts keep their devices alive, sub-devices are not needed past this point */
+    for (cl_device_id deviceId : devices) {
+        clReleaseDevice(deviceId);
+    }
 }
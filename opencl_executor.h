@@ -5,65 +5,224 @@
 #ifndef RAY_TRACING_OPENCL_EXECUTOR_H
 #define RAY_TRACING_OPENCL_EXECUTOR_H
 
+#include <string>
 #include "CL/cl.h"
 #include "scene.h"
 
 
+/**
+  Per ray result of the traversal kernels, mirrors HitRecord in cl_kernels.c.
+  primId < triangle count is a triangle index, otherwise a sphere index shifted by the triangle count,
+  -1 if nothing was hit.
+*/
+typedef struct _ClHitRecord {
+    cl_float t;
+    cl_float u;
+    cl_float v;
+    cl_int primId;
+} ClHitRecord;
+
+
+/**
+  Shading parameters of a material, mirrors Material in cl_kernels.c.
+  texOffset is the byte offset of the RGBA texture in the texel buffer, -1 if the material is not textured.
+*/
+typedef struct _ClMaterial {
+    cl_float color[3];
+    cl_float diffusiveFactor;
+    cl_float specularFactor;
+    cl_float specularHardness;
+    cl_float reflectionFactor;
+    cl_int texOffset;
+    cl_uint texWidth;
+    cl_uint texHeight;
+    cl_uint texSize;
+} ClMaterial;
+
+
+/**
+  Device buffer reused across calls, grows to the largest requested size.
+*/
+typedef struct _ClBuffer {
+    cl_mem mem;
+    size_t size;
+
+    _ClBuffer() : mem(0), size(0) {}
+} ClBuffer;
+
+
+/**
+  Device memory of one pipeline slot for the wavefront renderer. Rays, pixel ids and weights are double buffered:
+  one wavefront is traced while the reflections it spawns are compacted into the other.
+  scanSums/scanOffsets hold the group totals of every level of the prefix sum,
+  aoVisible/aoFactors the AO samples of the wavefront and their per-hit reduction
+*/
+typedef struct _ClWavefrontBuffers {
+    ClBuffer rays[2];
+    ClBuffer pixelIds[2];
+    ClBuffer weights[2];
+    ClBuffer hits;
+    ClBuffer pixels;
+    ClBuffer bounceRays;
+    ClBuffer bounceWeights;
+    ClBuffer bounceFlags;
+    ClBuffer bounceOffsets;
+    ClBuffer bounceCount;
+    ClBuffer aoVisible;
+    ClBuffer aoFactors;
+    std::vector<ClBuffer> scanSums;
+    std::vector<ClBuffer> scanOffsets;
+} ClWavefrontBuffers;
+
+
 class OpenClExecutor {
     const size_t TRIANGLE_SIZE = 12;
-    const size_t TRIANGLE_HIT_PARAM_SIZE = 9;
     const size_t SPHERE_SIZE = 4;
-    const size_t SPHERE_HIT_PARAM_SIZE = 7;
-    const size_t RAY_SIZE = 6;
+    const size_t RAY_SIZE = 8;
+    const size_t UV_SIZE = 6;
+    const size_t LAMP_SIZE = 5;
 
+    std::string mDeviceName;
     cl_context mContext;
     cl_command_queue mCommandQueue;
     cl_program mProgram;
 
-    cl_kernel mKrnHitTriangle;
     size_t mTriangleCount;
     cl_float *mTriangles;
     cl_mem mMemTriangles;
 
-    cl_kernel mKrnHitSphere;
     size_t mSphereCount;
     cl_float *mSpheres;
     cl_mem mMemSpheres;
 
+    cl_mem mMemBvhNodes;
+    cl_mem mMemBvhPrimIds;
+
+    /* shading tables, see shadeHits in cl_kernels.c */
+    cl_mem mMemMaterials;
+    cl_mem mMemPrimMaterials;
+    cl_mem mMemTriangleUvs;
+    cl_mem mMemTexels;
+    size_t mLampCount;
+    cl_mem mMemLamps;
+    cl_float3 mHorizonColor;
+    cl_float mAmbientFactor;
+
+    cl_kernel mKrnClosestHit;
+    cl_kernel mKrnAnyHit;
+    cl_kernel mKrnCameraRays;
+    cl_kernel mKrnShadeHits;
+    cl_kernel mKrnAmbientOcclusionRays;
+    cl_kernel mKrnReduceOcclusion;
+    cl_kernel mKrnScanGroups;
+    cl_kernel mKrnAddGroupOffsets;
+    cl_kernel mKrnCompactRays;
+    cl_kernel mKrnFinishPixels;
+    size_t mScanGroupSize;
+
+    /* buffers per pipeline slot, so in-flight batches never share device memory */
+    ClWavefrontBuffers mWavefronts[CL_PIPELINE_DEPTH];
+
 public:
-    OpenClExecutor(const Scene &scene);
+    OpenClExecutor(const Scene &scene, cl_device_id deviceId);
 
     ~OpenClExecutor();
 
+    const std::string &getDeviceName() const {
+        return mDeviceName;
+    }
+
+    /**
+      Renders pixels [firstPixel, firstPixel + pixelCount) of a width x height frame entirely on the device:
+      primary rays, closest hits, shadow rays, Phong shading and, with ENABLE_REFLECTION, up to
+      MAX_REFLECTION_DEPTH reflection bounces. resPixels receives gamma corrected RGB triples in image_bitmap
+      layout and must stay untouched until the returned event is passed to waitForEvent.
+      Every bounce waits for the size of the next wavefront, only the final read back is asynchronous
+    */
+    cl_event
+    enqueueRenderPixels(
+            cl_uint slot,
+            const glm::vec3 &camPos,
+            const glm::mat3 &camMat,
+            cl_uint width,
+            cl_uint height,
+            cl_uint firstPixel,
+            cl_uint pixelCount,
+            cl_float *resPixels
+    );
+
+    /**
+      Blocks until the event completes and releases it, 0 is a no-op
+    */
     void
-    computeClosestHitTriangle(
-            const cl_float *rays,
-            cl_uint rayCount,
-            std::vector<std::tuple<TriangleHit, size_t>> &resHits
+    waitForEvent(
+            cl_event event
     );
 
+private:
+    /**
+      Binds the scene buffers to the leading arguments shared by all hit kernels, returns the next argument index
+    */
+    cl_uint
+    setSceneArgs(
+            cl_kernel kernel
+    );
+
+    /**
+      Builds the program for the device, reusing a binary from the on-disk cache when one matches the device,
+      driver, build options and source
+    */
+    cl_program
+    buildProgram(
+            cl_device_id deviceId,
+            const std::string &source,
+            const std::string &options
+    );
+
+    /**
+      Material table, per primitive material indices, triangle UVs, texels and lamps for shadePixels
+    */
     void
-    computeClosestHitSphere(
-            const cl_float *rays,
-            cl_uint rayCount,
-            std::vector<std::tuple<SphereHit, size_t>> &resHits
+    uploadShadingTables(
+            const Scene &scene
     );
 
+    /**
+      Exclusive prefix sum of count uints, recursing over the work-group totals
+    */
     void
-    computeAnyHitTriangle(
-            const cl_float *rays,
-            cl_uint rayCount,
-            cl_char* resHits
+    enqueueExclusiveScan(
+            ClWavefrontBuffers &wavefront,
+            cl_mem values,
+            cl_mem result,
+            cl_uint count,
+            size_t level
     );
 
     void
-    computeAnyHitSphere(
-            const cl_float *rays,
-            cl_uint rayCount,
-            cl_char* resHits
+    releaseWavefront(
+            ClWavefrontBuffers &wavefront
+    );
+
+    cl_mem
+    createConstBuffer(
+            size_t size,
+            const void *data,
+            const char *msg
+    );
+
+    cl_mem
+    reserveBuffer(
+            ClBuffer &buffer,
+            size_t size,
+            const char *msg
+    );
+
+    void
+    releaseBuffer(
+            ClBuffer &buffer
     );
 
-private:
     void checkClResult(cl_int err, const char *msg) {
         if (err != CL_SUCCESS) {
             std::cerr << msg << ": " << err << std::endl;
@@ -71,26 +230,64 @@ private:
         }
     }
 
-    void putTriangle(const Triangle &triangle, float *dst) {
-        dst[0] = triangle.p.x;
-        dst[1] = triangle.p.y;
-        dst[2] = triangle.p.z;
-        dst[3] = triangle.e1.x;
-        dst[4] = triangle.e1.y;
-        dst[5] = triangle.e1.z;
-        dst[6] = triangle.e2.x;
-        dst[7] = triangle.e2.y;
-        dst[8] = triangle.e2.z;
-        dst[9] = triangle.norm.x;
-        dst[10] = triangle.norm.y;
-        dst[11] = triangle.norm.z;
+    void putTriangle(const TriangleArrays &triangles, size_t idx, float *dst) {
+        const glm::vec3 &p = triangles.points[idx];
+        const glm::vec3 &e1 = triangles.edges1[idx];
+        const glm::vec3 &e2 = triangles.edges2[idx];
+        const glm::vec3 &e1e2 = triangles.crosses[idx];
+        dst[0] = p.x;
+        dst[1] = p.y;
+        dst[2] = p.z;
+        dst[3] = e1.x;
+        dst[4] = e1.y;
+        dst[5] = e1.z;
+        dst[6] = e2.x;
+        dst[7] = e2.y;
+        dst[8] = e2.z;
+        dst[9] = e1e2.x;
+        dst[10] = e1e2.y;
+        dst[11] = e1e2.z;
+    }
+
+    void putSphere(const SphereArrays &spheres, size_t idx, float *dst) {
+        const glm::vec3 &center = spheres.centers[idx];
+        dst[0] = center.x;
+        dst[1] = center.y;
+        dst[2] = center.z;
+        dst[3] = spheres.radii[idx];
+    }
+};
+
+
+/**
+  Devices matching spec, a comma separated list of entries. gpu, cpu, accelerator and all select devices by type,
+  a number selects a device by its index over all platforms, anything else is matched against device names.
+  An entry may end with /N to split every matched device into sub-devices of N compute units.
+  A device matched by several entries is used once, split by the first entry that splits it if any.
+  Falls back to the first device if nothing matches. Returned ids are released with clReleaseDevice
+*/
+std::vector<cl_device_id>
+selectClDevices(
+        const std::string &spec
+);
+
+
+/**
+  One executor per selected device, all holding the same scene. Renderers hand work to them through
+  a shared counter, so faster devices simply take more of it
+*/
+class OpenClMultiExecutor {
+    std::vector<std::shared_ptr<OpenClExecutor>> mExecutors;
+
+public:
+    OpenClMultiExecutor(const Scene &scene, const std::string &deviceSpec);
+
+    size_t getDeviceCount() const {
+        return mExecutors.size();
     }
 
-    void putSphere(const Sphere &sphere, float *dst) {
-        dst[0] = sphere.center.x;
-        dst[1] = sphere.center.y;
-        dst[2] = sphere.center.z;
-        dst[3] = sphere.radius;
+    std::shared_ptr<OpenClExecutor> getExecutor(size_t idx) const {
+        return mExecutors[idx];
     }
 };
 
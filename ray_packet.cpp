@@ -0,0 +1,446 @@
+#include <algorithm>
+#include <cassert>
+#include "ray_packet.h"
+#include "ray_tracer.h"
+#include "bvh.h"
+
+
+typedef struct _PacketInvDir {
+    simd8f x;
+    simd8f y;
+    simd8f z;
+} PacketInvDir;
+
+
+static PacketInvDir
+inverseRayDirPacket(
+        const RayPacket &packet
+) {
+    float dirs[3][PACKET_SIZE];
+    packet.dirX.store(dirs[0]);
+    packet.dirY.store(dirs[1]);
+    packet.dirZ.store(dirs[2]);
+
+    float invDirs[3][PACKET_SIZE];
+    for (int i = 0; i < PACKET_SIZE; i++) {
+        glm::vec3 invDir = inverseRayDir(glm::vec3(dirs[0][i], dirs[1][i], dirs[2][i]));
+        invDirs[0][i] = invDir.x;
+        invDirs[1][i] = invDir.y;
+        invDirs[2][i] = invDir.z;
+    }
+
+    PacketInvDir result;
+    result.x = simd8f::load(invDirs[0]);
+    result.y = simd8f::load(invDirs[1]);
+    result.z = simd8f::load(invDirs[2]);
+    return result;
+}
+
+
+/**
+  intersectBvhNode for every lane, tEnter receives the entry distances
+*/
+static simd8b
+intersectBvhNodePacket(
+        const BvhNode &node,
+        const RayPacket &packet,
+        const PacketInvDir &invDir,
+        const simd8f &tMax,
+        simd8f &tEnter
+) {
+    simd8f t1x = (simd8f(node.bboxMin.x) - packet.fromX) * invDir.x;
+    simd8f t1y = (simd8f(node.bboxMin.y) - packet.fromY) * invDir.y;
+    simd8f t1z = (simd8f(node.bboxMin.z) - packet.fromZ) * invDir.z;
+    simd8f t2x = (simd8f(node.bboxMax.x) - packet.fromX) * invDir.x;
+    simd8f t2y = (simd8f(node.bboxMax.y) - packet.fromY) * invDir.y;
+    simd8f t2z = (simd8f(node.bboxMax.z) - packet.fromZ) * invDir.z;
+    tEnter = max(max(min(t1x, t2x), min(t1y, t2y)), min(t1z, t2z));
+    simd8f tExit = min(min(max(t1x, t2x), max(t1y, t2y)), max(t1z, t2z));
+    return (tExit >= tEnter) & (tExit > simd8f(0.0f)) & (tEnter <= tMax);
+}
+
+
+/**
+  computeTriangleHit for every lane
+*/
+static simd8b
+intersectTrianglePacket(
+        const TriangleArrays &triangles,
+        uint32_t triangleId,
+        const RayPacket &packet,
+        simd8f &t,
+        simd8f &u,
+        simd8f &v
+) {
+    const glm::vec3 &p = triangles.points[triangleId];
+    const glm::vec3 &e1 = triangles.edges1[triangleId];
+    const glm::vec3 &e2 = triangles.edges2[triangleId];
+    const glm::vec3 &e1e2 = triangles.crosses[triangleId];
+    simd8f qx = packet.fromX - simd8f(p.x);
+    simd8f qy = packet.fromY - simd8f(p.y);
+    simd8f qz = packet.fromZ - simd8f(p.z);
+
+    simd8f det = -(packet.dirX * simd8f(e1e2.x) + packet.dirY * simd8f(e1e2.y) + packet.dirZ * simd8f(e1e2.z));
+    simd8f dett = qx * simd8f(e1e2.x) + qy * simd8f(e1e2.y) + qz * simd8f(e1e2.z);
+
+    /* cross(q, rayDir) */
+    simd8f qdx = qy * packet.dirZ - qz * packet.dirY;
+    simd8f qdy = qz * packet.dirX - qx * packet.dirZ;
+    simd8f qdz = qx * packet.dirY - qy * packet.dirX;
+    simd8f detu = simd8f(e2.x) * qdx + simd8f(e2.y) * qdy + simd8f(e2.z) * qdz;
+    simd8f detv = -(simd8f(e1.x) * qdx + simd8f(e1.y) * qdy + simd8f(e1.z) * qdz);
+
+    t = dett / det;
+    u = detu / det;
+    v = detv / det;
+    simd8f zero(0.0f);
+    return (abs(det) >= simd8f(EPS)) & (t >= packet.tMin) & (t < packet.tMax)
+           & (u >= zero) & (v >= zero) & (v + u <= simd8f(1.0f));
+}
+
+
+/**
+  computeSphereHit for every lane, including its handling of the tangent case
+*/
+static simd8b
+intersectSpherePacket(
+        const SphereArrays &spheres,
+        uint32_t sphereId,
+        const RayPacket &packet,
+        simd8f &t
+) {
+    const glm::vec3 &center = spheres.centers[sphereId];
+    float radius = spheres.radii[sphereId];
+    simd8f vx = packet.fromX - simd8f(center.x);
+    simd8f vy = packet.fromY - simd8f(center.y);
+    simd8f vz = packet.fromZ - simd8f(center.z);
+    simd8f a = packet.dirX * packet.dirX + packet.dirY * packet.dirY + packet.dirZ * packet.dirZ;
+    simd8f b = simd8f(2.0f) * (vx * packet.dirX + vy * packet.dirY + vz * packet.dirZ);
+    simd8f c = (vx * vx + vy * vy + vz * vz) - simd8f(radius * radius);
+    simd8f d = b * b - simd8f(4.0f) * a * c;
+
+    simd8f eps(EPS);
+    simd8b tangent = abs(d) < eps;
+    simd8f tTangent = -b / simd8f(2.0f) * a;
+
+    simd8f sqrtD = sqrt(max(d, simd8f(0.0f)));
+    simd8f t1 = (-b + sqrtD) / (simd8f(2.0f) * a);
+    simd8f t2 = (-b - sqrtD) / (simd8f(2.0f) * a);
+    simd8b t1Valid = (t1 > packet.tMin) & (t1 < packet.tMax);
+    simd8b t2Valid = (t2 > packet.tMin) & (t2 < packet.tMax);
+    simd8f tGeneral = select(t1Valid & t2Valid, min(t1, t2), select(t1Valid, t1, t2));
+
+    t = select(tangent, tTangent, tGeneral);
+    simd8b tangentValid = (tTangent > packet.tMin) & (tTangent < packet.tMax);
+    simd8b valid = (tangent & tangentValid) | andNot(t1Valid | t2Valid, tangent);
+    return (d >= simd8f(0.0f)) & valid;
+}
+
+
+/**
+  Tests primId against the lanes in mask and records the closer hits in outHit
+*/
+static void
+intersectPrimClosest(
+        const Scene &scene,
+        uint32_t primId,
+        const RayPacket &packet,
+        const simd8b &mask,
+        PacketHit &outHit
+) {
+    simd8f t, u, v;
+    simd8b hitMask;
+    if (primId < scene.triangles.size()) {
+        hitMask = intersectTrianglePacket(scene.triangles, primId, packet, t, u, v);
+    } else {
+        hitMask = intersectSpherePacket(scene.spheres, primId - (uint32_t) scene.triangles.size(), packet, t);
+        u = simd8f(0.0f);
+        v = simd8f(0.0f);
+    }
+
+    simd8b closer = mask & hitMask & (t < outHit.t);
+    int bits = closer.bits();
+    if (bits == 0) {
+        return;
+    }
+    outHit.t = select(closer, t, outHit.t);
+    outHit.u = select(closer, u, outHit.u);
+    outHit.v = select(closer, v, outHit.v);
+    for (int i = 0; i < PACKET_SIZE; i++) {
+        if ((bits >> i) & 1) {
+            outHit.primId[i] = (int32_t) primId;
+        }
+    }
+}
+
+
+static simd8b
+intersectPrimAny(
+        const Scene &scene,
+        uint32_t primId,
+        const RayPacket &packet
+) {
+    simd8f t, u, v;
+    if (primId < scene.triangles.size()) {
+        return intersectTrianglePacket(scene.triangles, primId, packet, t, u, v);
+    } else {
+        return intersectSpherePacket(scene.spheres, primId - (uint32_t) scene.triangles.size(), packet, t);
+    }
+}
+
+
+RayPacket
+makeRayPacket(
+        const glm::vec3 *rayFroms,
+        const glm::vec3 *rayDirs,
+        int rayCount
+) {
+    float lanes[6][PACKET_SIZE] = {};
+    for (int i = 0; i < rayCount && i < PACKET_SIZE; i++) {
+        for (int k = 0; k < 3; k++) {
+            lanes[k][i] = rayFroms[i][k];
+            lanes[k + 3][i] = rayDirs[i][k];
+        }
+    }
+
+    RayPacket packet;
+    packet.fromX = simd8f::load(lanes[0]);
+    packet.fromY = simd8f::load(lanes[1]);
+    packet.fromZ = simd8f::load(lanes[2]);
+    packet.dirX = simd8f::load(lanes[3]);
+    packet.dirY = simd8f::load(lanes[4]);
+    packet.dirZ = simd8f::load(lanes[5]);
+    packet.tMin = simd8f(EPS);
+    packet.tMax = simd8f(INFINITY);
+    packet.active = simd8b::fromBits(rayCount >= PACKET_SIZE ? 0xff : (1 << rayCount) - 1);
+    return packet;
+}
+
+
+void
+computeClosestHitPacket(
+        const Scene &scene,
+        const RayPacket &packet,
+        PacketHit &outHit
+) {
+    /* outHit.t starts at the far end of every lane, nodes behind it are culled */
+    outHit.t = packet.tMax;
+    outHit.u = simd8f(0.0f);
+    outHit.v = simd8f(0.0f);
+    for (int i = 0; i < PACKET_SIZE; i++) {
+        outHit.primId[i] = -1;
+    }
+
+#ifdef ENABLE_BVH
+    if (scene.bvhNodes.empty()) {
+        return;
+    }
+
+    PacketInvDir invDir = inverseRayDirPacket(packet);
+    uint32_t stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const BvhNode &node = scene.bvhNodes[stack[--stackSize]];
+        simd8f tEnter;
+        simd8b nodeMask = packet.active & intersectBvhNodePacket(node, packet, invDir, outHit.t, tEnter);
+        if (none(nodeMask)) {
+            continue;
+        }
+
+        if (node.primCount > 0) {
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.primCount; i++) {
+                intersectPrimClosest(scene, scene.bvhPrimIds[i], packet, nodeMask, outHit);
+            }
+        } else {
+            /* buildBvh keeps leaves within BVH_STACK_SIZE - 1 levels, so both children always fit */
+            assert(stackSize + 2 <= BVH_STACK_SIZE);
+            /* the child the nearest lane enters first is visited first */
+            uint32_t near = node.leftFirst;
+            uint32_t far = node.leftFirst + 1;
+            simd8f tNear, tFar;
+            simd8b nearMask = nodeMask & intersectBvhNodePacket(scene.bvhNodes[near], packet, invDir, outHit.t, tNear);
+            simd8b farMask = nodeMask & intersectBvhNodePacket(scene.bvhNodes[far], packet, invDir, outHit.t, tFar);
+            float nearEntries[PACKET_SIZE];
+            float farEntries[PACKET_SIZE];
+            select(nearMask, tNear, simd8f(INFINITY)).store(nearEntries);
+            select(farMask, tFar, simd8f(INFINITY)).store(farEntries);
+            float nearMin = INFINITY;
+            float farMin = INFINITY;
+            for (int i = 0; i < PACKET_SIZE; i++) {
+                nearMin = std::min(nearMin, nearEntries[i]);
+                farMin = std::min(farMin, farEntries[i]);
+            }
+            if (farMin < nearMin) {
+                std::swap(near, far);
+                std::swap(nearMask, farMask);
+            }
+            if (any(farMask)) {
+                stack[stackSize++] = far;
+            }
+            if (any(nearMask)) {
+                stack[stackSize++] = near;
+            }
+        }
+    }
+#else
+    uint32_t primCount = (uint32_t) (scene.triangles.size() + scene.spheres.size());
+    for (uint32_t primId = 0; primId < primCount; primId++) {
+        intersectPrimClosest(scene, primId, packet, packet.active, outHit);
+    }
+#endif
+}
+
+
+simd8b
+computeAnyHitPacket(
+        const Scene &scene,
+        const RayPacket &packet
+) {
+    simd8b occluded;
+    simd8b pending = packet.active;
+
+#ifdef ENABLE_BVH
+    if (scene.bvhNodes.empty()) {
+        return occluded;
+    }
+
+    PacketInvDir invDir = inverseRayDirPacket(packet);
+    uint32_t stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const BvhNode &node = scene.bvhNodes[stack[--stackSize]];
+        simd8f tEnter;
+        simd8b nodeMask = pending & intersectBvhNodePacket(node, packet, invDir, packet.tMax, tEnter);
+        if (none(nodeMask)) {
+            continue;
+        }
+
+        if (node.primCount > 0) {
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.primCount; i++) {
+                occluded = occluded | (pending & intersectPrimAny(scene, scene.bvhPrimIds[i], packet));
+                pending = andNot(pending, occluded);
+                if (none(pending)) {
+                    return occluded;
+                }
+            }
+        } else {
+            assert(stackSize + 2 <= BVH_STACK_SIZE);
+            stack[stackSize++] = node.leftFirst + 1;
+            stack[stackSize++] = node.leftFirst;
+        }
+    }
+#else
+    uint32_t primCount = (uint32_t) (scene.triangles.size() + scene.spheres.size());
+    for (uint32_t primId = 0; primId < primCount && any(pending); primId++) {
+        occluded = occluded | (pending & intersectPrimAny(scene, primId, packet));
+        pending = andNot(pending, occluded);
+    }
+#endif
+
+    return occluded;
+}
+
+
+void
+tracePacket(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 *rayDirs,
+        const uint32_t *rngKeys,
+        int rayCount,
+        glm::vec3 *outColors,
+        Hit *outHits
+) {
+#if !defined(ENABLE_AO) && !defined(ENABLE_REFLECTION)
+    (void) rngKeys;
+#endif
+    glm::vec3 rayFroms[PACKET_SIZE];
+    for (int i = 0; i < rayCount; i++) {
+        rayFroms[i] = rayFrom;
+    }
+    RayPacket packet = makeRayPacket(rayFroms, rayDirs, rayCount);
+
+    PacketHit packetHit;
+    computeClosestHitPacket(scene, packet, packetHit);
+    float ts[PACKET_SIZE], us[PACKET_SIZE], vs[PACKET_SIZE];
+    packetHit.t.store(ts);
+    packetHit.u.store(us);
+    packetHit.v.store(vs);
+
+    /* default constructed hits are misses, lanes past rayCount stay that way */
+    Hit hits[PACKET_SIZE];
+    for (int i = 0; i < rayCount; i++) {
+        int32_t primId = packetHit.primId[i];
+        if (primId < 0) {
+            outColors[i] = scene.worldHorizonColor;
+            continue;
+        }
+
+        if ((size_t) primId < scene.triangles.size()) {
+            TriangleHit triangleHit(true, ts[i], us[i], vs[i]);
+            hits[i] = makeHit(scene, rayFrom, rayDirs[i], triangleHit, (uint32_t) primId, SphereHit(false), 0);
+        } else {
+            uint32_t sphereId = (uint32_t) (primId - scene.triangles.size());
+            SphereHit sphereHit(true, ts[i]);
+            hits[i] = makeHit(scene, rayFrom, rayDirs[i], TriangleHit(false), 0, sphereHit, sphereId);
+        }
+
+        outColors[i] = scene.worldAmbientColor;
+#ifdef ENABLE_AO
+        outColors[i] += hits[i].color * computeAmbientOcclusion(scene, hits[i].point, hits[i].norm, rayDirs[i], 0,
+                                                                  rngKeys[i]);
+#endif
+    }
+
+    /* one shadow packet per lamp, lanes facing away from the lamp stay inactive */
+    for (auto &lamp : scene.lamps) {
+        glm::vec3 toLamps[PACKET_SIZE];
+        glm::vec3 points[PACKET_SIZE];
+        int shadowBits = 0;
+        for (int i = 0; i < PACKET_SIZE; i++) {
+            points[i] = glm::vec3(0.0f);
+            toLamps[i] = glm::vec3(0.0f);
+            if (i < rayCount && hits[i].isHit) {
+                points[i] = hits[i].point;
+                toLamps[i] = lamp->pos - hits[i].point;
+                if (!isLampBehindSurface(toLamps[i], hits[i].norm, rayDirs[i])) {
+                    shadowBits |= 1 << i;
+                }
+            }
+        }
+        if (shadowBits == 0) {
+            continue;
+        }
+
+        RayPacket shadowPacket = makeRayPacket(points, toLamps, PACKET_SIZE);
+        shadowPacket.active = simd8b::fromBits(shadowBits);
+        /* toLamps are not normalized, so the lamp itself is at t = 1 */
+        shadowPacket.tMax = simd8f(1.0f);
+        int litBits = andNot(shadowPacket.active, computeAnyHitPacket(scene, shadowPacket)).bits();
+        for (int i = 0; i < rayCount; i++) {
+            if ((litBits >> i) & 1) {
+                outColors[i] += computeLampLight(scene.materials[hits[i].materialId], hits[i], *lamp, toLamps[i],
+                                                 rayDirs[i]);
+            }
+        }
+    }
+
+    if (outHits != nullptr) {
+        std::copy(hits, hits + rayCount, outHits);
+    }
+
+#ifdef ENABLE_REFLECTION
+    for (int i = 0; i < rayCount; i++) {
+        if (!hits[i].isHit) {
+            continue;
+        }
+        float reflectionFactor = scene.materials[hits[i].materialId].reflectionFactor;
+        if (reflectionFactor > EPS && MAX_REFLECTION_DEPTH > 0) {
+            glm::vec3 reflectedDir = rayDirs[i] - 2.0f * hits[i].norm * glm::dot(rayDirs[i], hits[i].norm);
+            outColors[i] += traceRay(scene, hits[i].point, reflectedDir, 1, rngKeys[i]) * reflectionFactor;
+        }
+    }
+#endif
+}
@@ -0,0 +1,84 @@
+#ifndef RAY_TRACING_RAY_PACKET_H
+#define RAY_TRACING_RAY_PACKET_H
+
+#include "scene.h"
+#include "simd8.h"
+
+#define PACKET_SIZE (8)
+
+
+/**
+  Up to 8 rays traced together, one per SIMD lane. Lanes outside active are never reported as hits,
+  every lane only counts hits between its tMin and tMax like computeClosestHit.
+*/
+typedef struct _RayPacket {
+    simd8f fromX;
+    simd8f fromY;
+    simd8f fromZ;
+    simd8f dirX;
+    simd8f dirY;
+    simd8f dirZ;
+    simd8f tMin;
+    simd8f tMax;
+    simd8b active;
+} RayPacket;
+
+
+/**
+  Closest hits of a packet. primId follows Scene::bvhPrimIds numbering, -1 if the lane hit nothing.
+*/
+typedef struct _PacketHit {
+    simd8f t;
+    simd8f u;
+    simd8f v;
+    int32_t primId[PACKET_SIZE];
+} PacketHit;
+
+
+/**
+  Lanes start at tMin = EPS and tMax = INFINITY
+*/
+RayPacket
+makeRayPacket(
+        const glm::vec3 *rayFroms,
+        const glm::vec3 *rayDirs,
+        int rayCount
+);
+
+
+void
+computeClosestHitPacket(
+        const Scene &scene,
+        const RayPacket &packet,
+        PacketHit &outHit
+);
+
+
+/**
+  Lanes of the packet blocked by any primitive, same semantics as computeAnyHit
+*/
+simd8b
+computeAnyHitPacket(
+        const Scene &scene,
+        const RayPacket &packet
+);
+
+
+/**
+  traceRay for up to 8 rays from rayFrom at depth 0, rngKeys holds the random stream of every ray.
+  Closest hits and the shadow rays towards every lamp are traced as packets,
+  reflections and AO fall back to the scalar tracer.
+*/
+void
+tracePacket(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 *rayDirs,
+        const uint32_t *rngKeys,
+        int rayCount,
+        glm::vec3 *outColors,
+        Hit *outHits = nullptr
+);
+
+
+#endif //RAY_TRACING_RAY_PACKET_H
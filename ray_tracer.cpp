@@ -1,49 +1,157 @@
 //
 // Created by vlad on 5/6/17.
 //
-#include <thread>
+#include <cassert>
 #include "ray_tracer.h"
+#include "bvh.h"
+#include "ray_packet.h"
+#include "ao_cache.h"
 
 void
 renderScene(
         image_bitmap &outImage,
         const Scene &scene
 ) {
-    renderScene(outImage, scene, outImage.getWidth(), outImage.getHeight(), 0, 0);
+    image_tile outTile = outImage.getTile(0, 0, outImage.getWidth(), outImage.getHeight());
+    renderScene(outTile, scene, outImage.getWidth(), outImage.getHeight());
 }
 
 void
 renderScene(
-        image_bitmap &outImg,
+        image_tile &outImg,
         const Scene &scene,
         int fullWidth,
-        int fullHeight,
-        int x,
-        int y
+        int fullHeight
 ) {
+#ifdef ENABLE_ADAPTIVE_AA
+    /* the first pass also covers a one pixel border, so edges on the seams between tiles are refined too */
+    int regionX = std::max(outImg.getX() - 1, 0);
+    int regionY = std::max(outImg.getY() - 1, 0);
+    int regionWidth = std::min(outImg.getX() + outImg.getWidth() + 1, fullWidth) - regionX;
+    int regionHeight = std::min(outImg.getY() + outImg.getHeight() + 1, fullHeight) - regionY;
+#else
+    int regionX = outImg.getX();
+    int regionY = outImg.getY();
+    int regionWidth = outImg.getWidth();
+    int regionHeight = outImg.getHeight();
+#endif
 
-    auto width = fullWidth;
-    auto height = fullHeight;
-    float camHeight = 0.5;
-    float camWidth = static_cast<float>(width) * (camHeight / static_cast<float>(height));
-    float camDist = 1.0;
-    float dh = camHeight / static_cast<float>(height);
-    float dw = camWidth / static_cast<float>(width);
+    std::vector<glm::vec3> colorSums(regionWidth * regionHeight, glm::vec3(0.0f));
+    std::vector<int> sampleCounts(regionWidth * regionHeight, 0);
+    std::vector<Hit> firstHits(regionWidth * regionHeight);
+
+    /* samples are queued until they fill a packet */
+    glm::vec3 rayDirs[PACKET_SIZE];
+    uint32_t rngKeys[PACKET_SIZE];
+    int rayPixels[PACKET_SIZE];
+    int rayCount = 0;
+    auto flushRays = [&]() {
+        glm::vec3 colors[PACKET_SIZE];
+        Hit hits[PACKET_SIZE];
+        tracePrimaryRays(scene, rayDirs, rngKeys, rayCount, colors, hits);
+        for (int k = 0; k < rayCount; k++) {
+            int pixel = rayPixels[k];
+            if (sampleCounts[pixel] == 0) {
+                firstHits[pixel] = hits[k];
+            }
+            colorSums[pixel] += colors[k];
+            sampleCounts[pixel]++;
+        }
+        rayCount = 0;
+    };
+    auto sampleDir = [&](int regionPixel, int sampleIdx) {
+        glm::vec2 offset = pixelSampleOffset(sampleIdx);
+        return cameraRayDir(scene, fullWidth, fullHeight, regionX + regionPixel % regionWidth + offset.x,
+                            regionY + regionPixel / regionWidth + offset.y);
+    };
+    auto queueRay = [&](int regionPixel, int sampleIdx) {
+        int px = regionX + regionPixel % regionWidth;
+        int py = regionY + regionPixel / regionWidth;
+        rayDirs[rayCount] = sampleDir(regionPixel, sampleIdx);
+        rngKeys[rayCount] = randomKey((uint32_t) (py * fullWidth + px), (uint32_t) sampleIdx);
+        rayPixels[rayCount] = regionPixel;
+        if (++rayCount == PACKET_SIZE) {
+            flushRays();
+        }
+    };
+
+#ifdef ENABLE_ADAPTIVE_AA
+    int tileX = outImg.getX() - regionX;
+    int tileY = outImg.getY() - regionY;
     for (int i = 0; i < outImg.getHeight(); i++) {
         for (int j = 0; j < outImg.getWidth(); j++) {
-            float rayX = -(camWidth / 2) + (j + x) * dw;
-            float rayY = -(camHeight / 2) + (i + y) * dh;
-            glm::vec3 rayCamDir(rayX, rayY, -camDist);
-            glm::vec3 rayDx(dw / 2.0f, 0.0f, 0.0f);
-            glm::vec3 rayDy(0.0f, dh / 2.0f, 0.0f);
-            glm::vec3 rayWorldDir = rayCamDir * scene.camMat;
-            glm::vec3 rayWorldDx = rayDx * scene.camMat;
-            glm::vec3 rayWorldDy = rayDy * scene.camMat;
-            auto traceColor = traceRay(scene, scene.camPos, glm::normalize(rayWorldDir), 0);
-            traceColor += traceRay(scene, scene.camPos, glm::normalize(rayWorldDir + rayWorldDx), 0);
-            traceColor += traceRay(scene, scene.camPos, glm::normalize(rayWorldDir + rayWorldDy), 0);
-            traceColor += traceRay(scene, scene.camPos, glm::normalize(rayWorldDir + rayWorldDx + rayWorldDy), 0);
-            traceColor /= 4.0f;
+            queueRay((tileY + i) * regionWidth + tileX + j, 0);
+        }
+    }
+    flushRays();
+
+    /*
+      Border pixels are not shaded, comparisons across the tile border use the first hit and the direct light
+      of both pixels instead, without AO or reflections. Neighbouring tiles then agree on their common edges
+    */
+    std::vector<glm::vec3> directColors(regionWidth * regionHeight);
+    std::vector<bool> hasDirectColor(regionWidth * regionHeight, false);
+    auto directColor = [&](int regionPixel) -> const glm::vec3 & {
+        if (!hasDirectColor[regionPixel]) {
+            glm::vec3 rayDir = sampleDir(regionPixel, 0);
+            if (sampleCounts[regionPixel] == 0) {
+                firstHits[regionPixel] = computeClosestHit(scene, scene.camPos, rayDir);
+            }
+            directColors[regionPixel] = computeDirectColor(scene, firstHits[regionPixel], rayDir);
+            hasDirectColor[regionPixel] = true;
+        }
+        return directColors[regionPixel];
+    };
+
+    /* decided before queueing any refinement, refined samples would change the colors compared */
+    std::vector<int> edgePixels;
+    for (int i = 0; i < outImg.getHeight(); i++) {
+        for (int j = 0; j < outImg.getWidth(); j++) {
+            int rx = tileX + j;
+            int ry = tileY + i;
+            int pixel = ry * regionWidth + rx;
+            const int neighbours[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+            bool onEdge = false;
+            for (auto &neighbour : neighbours) {
+                int nx = rx + neighbour[0];
+                int ny = ry + neighbour[1];
+                if (nx < 0 || ny < 0 || nx >= regionWidth || ny >= regionHeight) {
+                    continue;
+                }
+                int other = ny * regionWidth + nx;
+                bool otherInTile = nx >= tileX && ny >= tileY && nx < tileX + outImg.getWidth() &&
+                                   ny < tileY + outImg.getHeight();
+                bool edge = otherInTile
+                            ? isAaEdge(firstHits[pixel], colorSums[pixel], firstHits[other], colorSums[other])
+                            : isAaEdge(firstHits[pixel], directColor(pixel), firstHits[other], directColor(other));
+                if (edge) {
+                    onEdge = true;
+                    break;
+                }
+            }
+            if (onEdge) {
+                edgePixels.push_back(pixel);
+            }
+        }
+    }
+    for (int pixel : edgePixels) {
+        for (int k = 1; k < AA_MAX_SAMPLES; k++) {
+            queueRay(pixel, k);
+        }
+    }
+#else
+    for (int i = 0; i < regionWidth * regionHeight; i++) {
+        for (int k = 0; k < AA_MAX_SAMPLES; k++) {
+            queueRay(i, k);
+        }
+    }
+#endif
+    flushRays();
+
+    for (int i = 0; i < outImg.getHeight(); i++) {
+        for (int j = 0; j < outImg.getWidth(); j++) {
+            int pixel = (outImg.getY() + i - regionY) * regionWidth + (outImg.getX() + j - regionX);
+            glm::vec3 traceColor = colorSums[pixel] / static_cast<float>(sampleCounts[pixel]);
             outImg.setPixel(j, i,
                             powf(traceColor.r / 2.2f, 0.3f),
                             powf(traceColor.g / 2.2f, 0.3f),
@@ -54,25 +162,92 @@ renderScene(
 }
 
 
-std::shared_ptr<bool>
-renderParallel(
-        std::shared_ptr<Scene> scene,
-        std::shared_ptr<synchronized_queue<std::tuple<int, int, std::shared_ptr<image_bitmap>>>> outQueue,
+glm::vec3
+cameraRayDir(
+        const Scene &scene,
+        int fullWidth,
+        int fullHeight,
+        float px,
+        float py
+) {
+    float camHeight = 0.5;
+    float camWidth = static_cast<float>(fullWidth) * (camHeight / static_cast<float>(fullHeight));
+    float camDist = 1.0;
+    float dh = camHeight / static_cast<float>(fullHeight);
+    float dw = camWidth / static_cast<float>(fullWidth);
+    glm::vec3 rayCamDir(-(camWidth / 2) + px * dw, -(camHeight / 2) + py * dh, -camDist);
+    return glm::normalize(rayCamDir * scene.camMat);
+}
+
+
+glm::vec2
+pixelSampleOffset(
+        int sampleIdx
+) {
+    int gridSize = static_cast<int>(ceilf(sqrtf(static_cast<float>(AA_MAX_SAMPLES))));
+    return glm::vec2(
+            static_cast<float>(sampleIdx % gridSize) / static_cast<float>(gridSize),
+            static_cast<float>(sampleIdx / gridSize) / static_cast<float>(gridSize)
+    );
+}
+
+
+void
+tracePrimaryRays(
+        const Scene &scene,
+        const glm::vec3 *rayDirs,
+        const uint32_t *rngKeys,
+        int rayCount,
+        glm::vec3 *outColors,
+        Hit *outHits
+) {
+#ifdef ENABLE_RAY_PACKETS
+    tracePacket(scene, scene.camPos, rayDirs, rngKeys, rayCount, outColors, outHits);
+#else
+    for (int k = 0; k < rayCount; k++) {
+        outColors[k] = traceRay(scene, scene.camPos, rayDirs[k], 0, rngKeys[k],
+                                outHits != nullptr ? outHits + k : nullptr);
+    }
+#endif
+}
+
+
+bool
+isAaEdge(
+        const Hit &hitA,
+        const glm::vec3 &colorA,
+        const Hit &hitB,
+        const glm::vec3 &colorB
+) {
+    if (hitA.isHit != hitB.isHit) {
+        return true;
+    }
+    if (hitA.isHit) {
+        if (hitA.primId != hitB.primId || hitA.materialId != hitB.materialId) {
+            return true;
+        }
+        if (glm::dot(hitA.norm, hitB.norm) < AA_NORMAL_THRESHOLD) {
+            return true;
+        }
+    }
+    glm::vec3 diff = colorA - colorB;
+    return std::max(std::max(fabsf(diff.r), fabsf(diff.g)), fabsf(diff.b)) > AA_COLOR_THRESHOLD;
+}
+
+
+std::vector<std::tuple<int, int, int, int>>
+splitSubBlocks(
         int width,
         int height
 ) {
-    std::shared_ptr<std::vector<std::tuple<int, int, int, int>>> inQueue(
-            new std::vector<std::tuple<int, int, int, int>>()
-    );
-    std::shared_ptr<std::mutex> inQueueMutex(new std::mutex());
-    std::shared_ptr<bool> finishedFlag(new bool(false));
+    std::vector<std::tuple<int, int, int, int>> subBlocks;
     int fullHorzBlocks = width / SUB_BLOCK_WIDTH;
     int fullVertBlocks = height / SUB_BLOCK_HEIGHT;
     int lastHorzBlockWidth = width % SUB_BLOCK_WIDTH;
     int lastVertBlockHeight = height % SUB_BLOCK_HEIGHT;
     for (int i = 0; i < fullVertBlocks; i++) {
         for (int j = 0; j < fullHorzBlocks; j++) {
-            inQueue->push_back(std::make_tuple(
+            subBlocks.push_back(std::make_tuple(
                     j * SUB_BLOCK_WIDTH,
                     i * SUB_BLOCK_HEIGHT,
                     SUB_BLOCK_WIDTH,
@@ -83,7 +258,7 @@ renderParallel(
 
     if (lastHorzBlockWidth > 0) {
         for (int i = 0; i < fullVertBlocks; i++) {
-            inQueue->push_back(std::make_tuple(
+            subBlocks.push_back(std::make_tuple(
                     fullHorzBlocks * SUB_BLOCK_WIDTH,
                     i * SUB_BLOCK_HEIGHT,
                     lastHorzBlockWidth,
@@ -94,7 +269,7 @@ renderParallel(
 
     if (lastVertBlockHeight > 0) {
         for (int i = 0; i < fullHorzBlocks; i++) {
-            inQueue->push_back(std::make_tuple(
+            subBlocks.push_back(std::make_tuple(
                     i * SUB_BLOCK_WIDTH,
                     fullVertBlocks * SUB_BLOCK_HEIGHT,
                     SUB_BLOCK_WIDTH,
@@ -104,100 +279,195 @@ renderParallel(
     }
 
     if (lastHorzBlockWidth > 0 && lastVertBlockHeight > 0) {
-        inQueue->push_back(std::make_tuple(
+        subBlocks.push_back(std::make_tuple(
                 fullHorzBlocks * SUB_BLOCK_WIDTH,
                 fullVertBlocks * SUB_BLOCK_HEIGHT,
                 lastHorzBlockWidth,
                 lastVertBlockHeight
         ));
     }
+    return subBlocks;
+}
 
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        std::thread thread(taskProcessor, scene, finishedFlag, outQueue, inQueue, inQueueMutex, width, height);
-        thread.detach();
+
+std::shared_future<void>
+renderParallel(
+        thread_pool &pool,
+        std::shared_ptr<Scene> scene,
+        std::shared_ptr<image_bitmap> outImg,
+        std::shared_ptr<mpsc_queue<std::tuple<int, int, int, int>>> outQueue,
+        int width,
+        int height
+) {
+    std::vector<std::tuple<int, int, int, int>> subBlocks = splitSubBlocks(width, height);
+    std::vector<std::function<void()>> tasks;
+    tasks.reserve(subBlocks.size());
+    for (auto &subBlock : subBlocks) {
+        int x = std::get<0>(subBlock);
+        int y = std::get<1>(subBlock);
+        int w = std::get<2>(subBlock);
+        int h = std::get<3>(subBlock);
+        image_tile outTile = outImg->getTile(x, y, w, h);
+        tasks.push_back([scene, outImg, outTile, outQueue, width, height]() {
+            renderSubBlock(*scene, outTile, *outQueue, width, height);
+        });
     }
 
-    return finishedFlag;
+    return pool.submitAll(std::move(tasks));
 }
 
 
-void taskProcessor(
+std::shared_future<void>
+renderProgressivePass(
+        thread_pool &pool,
         std::shared_ptr<Scene> scene,
-        std::shared_ptr<bool> finishedFlag,
-        std::shared_ptr<synchronized_queue<std::tuple<int, int, std::shared_ptr<image_bitmap>>>> outQueue,
-        std::shared_ptr<std::vector<std::tuple<int, int, int, int>>> inQueue,
-        std::shared_ptr<std::mutex> inQueueMutex,
+        std::shared_ptr<image_bitmap> accumImg,
+        std::shared_ptr<image_bitmap> outImg,
+        uint32_t passIdx,
+        int width,
+        int height
+) {
+    std::vector<std::tuple<int, int, int, int>> subBlocks = splitSubBlocks(width, height);
+    std::vector<std::function<void()>> tasks;
+    tasks.reserve(subBlocks.size());
+    for (auto &subBlock : subBlocks) {
+        int x = std::get<0>(subBlock);
+        int y = std::get<1>(subBlock);
+        int w = std::get<2>(subBlock);
+        int h = std::get<3>(subBlock);
+        image_tile accumTile = accumImg->getTile(x, y, w, h);
+        image_tile outTile = outImg->getTile(x, y, w, h);
+        tasks.push_back([scene, accumImg, outImg, accumTile, outTile, passIdx, width, height]() {
+            renderProgressiveBlock(*scene, accumTile, outTile, passIdx, width, height);
+        });
+    }
+
+    return pool.submitAll(std::move(tasks));
+}
+
+
+void
+renderProgressiveBlock(
+        const Scene &scene,
+        image_tile accumTile,
+        image_tile outTile,
+        uint32_t passIdx,
         int fullWidth,
         int fullHeight
 ) {
-    while (true) {
-        int x, y, w, h;
-        {
-            std::lock_guard<std::mutex> lock(*inQueueMutex);
-            if (inQueue->size() == 0) {
-                *finishedFlag = true;
-                return;
-            }
+    int pixelCount = outTile.getWidth() * outTile.getHeight();
+    for (int first = 0; first < pixelCount; first += PACKET_SIZE) {
+        int rayCount = std::min(PACKET_SIZE, pixelCount - first);
+        glm::vec3 rayDirs[PACKET_SIZE];
+        uint32_t rngKeys[PACKET_SIZE];
+        for (int k = 0; k < rayCount; k++) {
+            int px = outTile.getX() + (first + k) % outTile.getWidth();
+            int py = outTile.getY() + (first + k) / outTile.getWidth();
+            /* the jitter uses the first counters of the sample stream, the tracer a stream derived from it */
+            uint32_t sampleKey = randomKey((uint32_t) (py * fullWidth + px), passIdx);
+            float jitterX = randomFloat(sampleKey, 0);
+            float jitterY = randomFloat(sampleKey, 1);
+            rayDirs[k] = cameraRayDir(scene, fullWidth, fullHeight, px + jitterX, py + jitterY);
+            rngKeys[k] = pcgHash(sampleKey);
+        }
+
+        glm::vec3 colors[PACKET_SIZE];
+        tracePrimaryRays(scene, rayDirs, rngKeys, rayCount, colors, nullptr);
 
-            auto subBlock = (*inQueue)[inQueue->size() - 1];
-            x = std::get<0>(subBlock);
-            y = std::get<1>(subBlock);
-            w = std::get<2>(subBlock);
-            h = std::get<3>(subBlock);
-            inQueue->pop_back();
+        for (int k = 0; k < rayCount; k++) {
+            int tx = (first + k) % outTile.getWidth();
+            int ty = (first + k) / outTile.getWidth();
+            glm::vec3 sum = colors[k];
+            if (passIdx > 0) {
+                float *accumPixel = accumTile.getPixel(tx, ty);
+                sum += glm::vec3(accumPixel[0], accumPixel[1], accumPixel[2]);
+            }
+            accumTile.setPixel(tx, ty, sum.r, sum.g, sum.b);
+            glm::vec3 traceColor = sum / static_cast<float>(passIdx + 1);
+            outTile.setPixel(tx, ty,
+                             powf(traceColor.r / 2.2f, 0.3f),
+                             powf(traceColor.g / 2.2f, 0.3f),
+                             powf(traceColor.b / 2.2f, 0.3f)
+            );
         }
-        std::shared_ptr<image_bitmap> outImg(new image_bitmap(w, h));
-        renderScene(*outImg, *scene, fullWidth, fullHeight, x, y);
-        outQueue->push_back(std::make_tuple(x, y, outImg));
     }
 }
 
 
+void
+renderSubBlock(
+        const Scene &scene,
+        image_tile outTile,
+        mpsc_queue<std::tuple<int, int, int, int>> &outQueue,
+        int fullWidth,
+        int fullHeight
+) {
+    renderScene(outTile, scene, fullWidth, fullHeight);
+    outQueue.push(std::make_tuple(outTile.getX(), outTile.getY(), outTile.getWidth(), outTile.getHeight()));
+}
+
+
 glm::vec3
 traceRay(
         const Scene &scene,
         const glm::vec3 &rayFrom,
         const glm::vec3 &rayDir,
-        uint32_t depth
+        uint32_t depth,
+        uint32_t rngKey,
+        Hit *outHit
 ) {
+#if !defined(ENABLE_AO) && !defined(ENABLE_REFLECTION)
+    /* only AO and reflections draw random numbers */
+    (void) rngKey;
+#endif
     Hit hit = computeClosestHit(scene, rayFrom, rayDir);
+    if (outHit != nullptr) {
+        *outHit = hit;
+    }
 
+    glm::vec3 retColor = computeDirectColor(scene, hit, rayDir);
     if (hit.isHit) {
-        glm::vec3 retColor = scene.worldAmbientColor;
 #ifdef ENABLE_AO
-        retColor += hit.color * computeAmbientOcclusion(scene, hit.point, hit.norm, rayDir);
+        retColor += hit.color * computeAmbientOcclusion(scene, hit.point, hit.norm, rayDir, depth, rngKey);
 #endif
-        for (auto &lamp : scene.lamps) {
-            bool shaded = false;
-            glm::vec3 toLamp = lamp->pos - hit.point;
-
-            float dotWithLamp = glm::dot(toLamp, hit.norm);
-            float dotWithDir = glm::dot(rayDir, hit.norm);
-            if ((dotWithDir < 0.0 && dotWithLamp < 0.0) || (dotWithDir > 0.0 && dotWithLamp > 0.0)) {
-                shaded = true;
-            }
-
-            if (!shaded) {
-                shaded |= computeAnyHit(scene, hit.point, toLamp);
-            }
-
-            if (!shaded) {
-                retColor += hit.color * hit.mtl->diffusiveFactor * computeDiffusiveLight(*lamp, toLamp, hit.norm);
-                retColor += hit.color * hit.mtl->specularFactor *
-                            computePhongLight(*lamp, toLamp, hit.norm, rayDir, hit.mtl->specularHardness);
-            }
-        }
 #ifdef ENABLE_REFLECTION
-        if (hit.mtl->reflectionFactor > EPS && depth < MAX_REFLECTION_DEPTH) {
+        float reflectionFactor = scene.materials[hit.materialId].reflectionFactor;
+        if (reflectionFactor > EPS && depth < MAX_REFLECTION_DEPTH) {
             retColor += traceRay(scene, hit.point, rayDir - 2.0f * hit.norm * glm::dot(rayDir, hit.norm),
-                                 depth + 1) *
-                        hit.mtl->reflectionFactor;
+                                 depth + 1, rngKey) *
+                        reflectionFactor;
         }
 #endif
-        return retColor;
-    } else {
+    }
+    return retColor;
+}
+
+
+glm::vec3
+computeDirectColor(
+        const Scene &scene,
+        const Hit &hit,
+        const glm::vec3 &rayDir
+) {
+    if (!hit.isHit) {
         return scene.worldHorizonColor;
     }
+
+    glm::vec3 retColor = scene.worldAmbientColor;
+    for (auto &lamp : scene.lamps) {
+        glm::vec3 toLamp = lamp->pos - hit.point;
+        bool shaded = isLampBehindSurface(toLamp, hit.norm, rayDir);
+
+        if (!shaded) {
+            /* toLamp is not normalized, so the lamp itself is at t = 1 */
+            shaded |= computeAnyHit(scene, hit.point, toLamp, EPS, 1.0f);
+        }
+
+        if (!shaded) {
+            retColor += computeLampLight(scene.materials[hit.materialId], hit, *lamp, toLamp, rayDir);
+        }
+    }
+    return retColor;
 }
 
 
@@ -205,66 +475,270 @@ Hit
 computeClosestHit(
         const Scene &scene,
         const glm::vec3 &rayFrom,
-        const glm::vec3 &rayDir
+        const glm::vec3 &rayDir,
+        float tMin,
+        float tMax
+) {
+#ifdef ENABLE_BVH
+    return computeClosestHitBvh(scene, rayFrom, rayDir, tMin, tMax);
+#else
+    return computeClosestHitLinear(scene, rayFrom, rayDir, tMin, tMax);
+#endif
+}
+
+
+bool
+computeAnyHit(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        float tMin,
+        float tMax
+) {
+#ifdef ENABLE_BVH
+    return computeAnyHitBvh(scene, rayFrom, rayDir, tMin, tMax);
+#else
+    return computeAnyHitLinear(scene, rayFrom, rayDir, tMin, tMax);
+#endif
+}
+
+
+Hit
+computeClosestHitBvh(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        float tMin,
+        float tMax
+) {
+    TriangleHit closestTriangleHit(false);
+    uint32_t closestTriangle = 0;
+    SphereHit closestSphereHit(false);
+    uint32_t closestSphere = 0;
+
+    if (scene.bvhNodes.empty()) {
+        return Hit(false);
+    }
+
+    glm::vec3 rayInvDir = inverseRayDir(rayDir);
+    /* closestT starts at the far end of the ray, nodes behind it are culled */
+    float closestT = tMax;
+    uint32_t stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const BvhNode &node = scene.bvhNodes[stack[--stackSize]];
+        if (intersectBvhNode(node, rayFrom, rayInvDir, closestT) == INFINITY) {
+            continue;
+        }
+
+        if (node.primCount > 0) {
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.primCount; i++) {
+                uint32_t primId = scene.bvhPrimIds[i];
+                if (primId < scene.triangles.size()) {
+                    auto hit = computeTriangleHit(scene.triangles, primId, rayFrom, rayDir, tMin, tMax);
+                    if (hit.isHit && hit.t > 0 && (!closestTriangleHit.isHit || hit.t < closestTriangleHit.t)) {
+                        closestTriangleHit = hit;
+                        closestTriangle = primId;
+                        closestT = std::min(closestT, hit.t);
+                    }
+                } else {
+                    uint32_t sphereId = primId - (uint32_t) scene.triangles.size();
+                    auto hit = computeSphereHit(scene.spheres, sphereId, rayFrom, rayDir, tMin, tMax);
+                    if (hit.isHit && hit.t > 0 && (!closestSphereHit.isHit || hit.t < closestSphereHit.t)) {
+                        closestSphereHit = hit;
+                        closestSphere = sphereId;
+                        closestT = std::min(closestT, hit.t);
+                    }
+                }
+            }
+        } else {
+            /* buildBvh keeps leaves within BVH_STACK_SIZE - 1 levels, so both children always fit */
+            assert(stackSize + 2 <= BVH_STACK_SIZE);
+            /* visit the nearer child first so that the farther one is likely culled by closestT */
+            uint32_t near = node.leftFirst;
+            uint32_t far = node.leftFirst + 1;
+            float tNear = intersectBvhNode(scene.bvhNodes[near], rayFrom, rayInvDir, closestT);
+            float tFar = intersectBvhNode(scene.bvhNodes[far], rayFrom, rayInvDir, closestT);
+            if (tFar < tNear) {
+                std::swap(near, far);
+                std::swap(tNear, tFar);
+            }
+            if (tFar != INFINITY) {
+                stack[stackSize++] = far;
+            }
+            if (tNear != INFINITY) {
+                stack[stackSize++] = near;
+            }
+        }
+    }
+
+    return makeHit(scene, rayFrom, rayDir, closestTriangleHit, closestTriangle, closestSphereHit, closestSphere);
+}
+
+
+bool
+computeAnyHitBvh(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        float tMin,
+        float tMax
+) {
+    if (scene.bvhNodes.empty()) {
+        return false;
+    }
+
+    glm::vec3 rayInvDir = inverseRayDir(rayDir);
+    uint32_t stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const BvhNode &node = scene.bvhNodes[stack[--stackSize]];
+        if (intersectBvhNode(node, rayFrom, rayInvDir, tMax) == INFINITY) {
+            continue;
+        }
+
+        if (node.primCount > 0) {
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.primCount; i++) {
+                uint32_t primId = scene.bvhPrimIds[i];
+                if (primId < scene.triangles.size()) {
+                    if (computeTriangleHit(scene.triangles, primId, rayFrom, rayDir, tMin, tMax).isHit) {
+                        return true;
+                    }
+                } else {
+                    uint32_t sphereId = primId - (uint32_t) scene.triangles.size();
+                    if (computeSphereHit(scene.spheres, sphereId, rayFrom, rayDir, tMin, tMax).isHit) {
+                        return true;
+                    }
+                }
+            }
+        } else {
+            assert(stackSize + 2 <= BVH_STACK_SIZE);
+            stack[stackSize++] = node.leftFirst + 1;
+            stack[stackSize++] = node.leftFirst;
+        }
+    }
+
+    return false;
+}
+
+
+Hit
+computeClosestHitLinear(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        float tMin,
+        float tMax
 ) {
     TriangleHit closestTriangleHit(false);
-    std::shared_ptr<Triangle> closestTriangle;
-    for (auto &obj : scene.triangles) {
-        auto hit = computeTriangleHit(*obj, rayFrom, rayDir);
+    uint32_t closestTriangle = 0;
+    for (uint32_t i = 0; i < scene.triangles.size(); i++) {
+        auto hit = computeTriangleHit(scene.triangles, i, rayFrom, rayDir, tMin, tMax);
         if (hit.isHit && hit.t > 0 && (!closestTriangleHit.isHit || hit.t < closestTriangleHit.t)) {
             closestTriangleHit = hit;
-            closestTriangle = obj;
+            closestTriangle = i;
         }
     }
 
     SphereHit closestSphereHit(false);
-    std::shared_ptr<Sphere> closestSphere;
-    for (auto &obj : scene.spheres) {
-        auto hit = computeSphereHit(*obj, rayFrom, rayDir);
+    uint32_t closestSphere = 0;
+    for (uint32_t i = 0; i < scene.spheres.size(); i++) {
+        auto hit = computeSphereHit(scene.spheres, i, rayFrom, rayDir, tMin, tMax);
         if (hit.isHit && hit.t > 0 && (!closestSphereHit.isHit || hit.t < closestSphereHit.t)) {
             closestSphereHit = hit;
-            closestSphere = obj;
+            closestSphere = i;
         }
     }
 
+    return makeHit(scene, rayFrom, rayDir, closestTriangleHit, closestTriangle, closestSphereHit, closestSphere);
+}
+
+
+bool
+computeAnyHitLinear(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        float tMin,
+        float tMax
+) {
+    for (uint32_t i = 0; i < scene.triangles.size(); i++) {
+        auto hit = computeTriangleHit(scene.triangles, i, rayFrom, rayDir, tMin, tMax);
+        if (hit.isHit) {
+            return true;
+        }
+    }
+
+    for (uint32_t i = 0; i < scene.spheres.size(); i++) {
+        auto hit = computeSphereHit(scene.spheres, i, rayFrom, rayDir, tMin, tMax);
+        if (hit.isHit) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+Hit
+makeHit(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        const TriangleHit &closestTriangleHit,
+        uint32_t triangleId,
+        const SphereHit &closestSphereHit,
+        uint32_t sphereId
+) {
     if (closestTriangleHit.isHit && (!closestSphereHit.isHit || closestTriangleHit.t < closestSphereHit.t)) {
         /* Triangle */
-        if (closestTriangle->material->textured) {
-            glm::vec2 uvCoord = closestTriangle->uvStart
-                                + closestTriangle->uvU * closestTriangleHit.u
-                                + closestTriangle->uvV * closestTriangleHit.v;
-            glm::vec4 rgbaColor = closestTriangle->material->texImage->get((unsigned int) uvCoord.x,
-                                                                           (unsigned int) uvCoord.y);
+        glm::vec3 point = rayFrom + closestTriangleHit.t * rayDir;
+        const glm::vec3 &norm = scene.triangles.norms[triangleId];
+        uint32_t materialId = scene.triangles.materialIds[triangleId];
+        const Material &material = scene.materials[materialId];
+        if (material.textured) {
+            glm::vec2 uvCoord = scene.triangles.uvStarts[triangleId]
+                                + scene.triangles.uvUs[triangleId] * closestTriangleHit.u
+                                + scene.triangles.uvVs[triangleId] * closestTriangleHit.v;
+            glm::vec4 rgbaColor = material.texImage->get((unsigned int) uvCoord.x, (unsigned int) uvCoord.y);
             glm::vec3 rgbColor = rgbaColor.a * glm::vec3(rgbaColor.r, rgbaColor.g, rgbaColor.b)
-                                 + (1 - rgbaColor.a) * closestTriangle->material->color;
+                                 + (1 - rgbaColor.a) * material.color;
             return Hit(
                     true,
-                    closestTriangle->material,
-                    closestTriangleHit.point,
-                    closestTriangleHit.norm,
+                    materialId,
+                    point,
+                    norm,
                     rgbColor,
-                    closestTriangleHit.t
+                    closestTriangleHit.t,
+                    triangleId
             );
 
         } else {
             return Hit(
                     true,
-                    closestTriangle->material,
-                    closestTriangleHit.point,
-                    closestTriangleHit.norm,
-                    closestTriangle->material->color,
-                    closestTriangleHit.t
+                    materialId,
+                    point,
+                    norm,
+                    material.color,
+                    closestTriangleHit.t,
+                    triangleId
             );
         }
     } else if (closestSphereHit.isHit) {
         /* Sphere */
+        glm::vec3 point = rayFrom + closestSphereHit.t * rayDir;
+        glm::vec3 norm = (point - scene.spheres.centers[sphereId]) / scene.spheres.radii[sphereId];
+        uint32_t materialId = scene.spheres.materialIds[sphereId];
         return Hit(
                 true,
-                closestSphere->material,
-                closestSphereHit.point,
-                closestSphereHit.norm,
-                closestSphere->material->color,
-                closestSphereHit.t
+                materialId,
+                point,
+                norm,
+                scene.materials[materialId].color,
+                closestSphereHit.t,
+                (uint32_t) scene.triangles.size() + sphereId
         );
     } else {
         /* None */
@@ -273,80 +747,67 @@ computeClosestHit(
 }
 
 
-bool
-computeAnyHit(
-        const Scene &scene,
-        const glm::vec3 &rayFrom,
-        const glm::vec3 &rayDir
-) {
-    for (auto &obj : scene.triangles) {
-        auto hit = computeTriangleHit(*obj, rayFrom, rayDir);
-        if (hit.isHit) {
-            return true;
-        }
-    }
-
-    for (auto &obj : scene.spheres) {
-        auto hit = computeSphereHit(*obj, rayFrom, rayDir);
-        if (hit.isHit) {
-            return true;
-        }
-    }
-
-    return false;
-}
-
-
 TriangleHit
 computeTriangleHit(
-        const Triangle &triangle,
+        const TriangleArrays &triangles,
+        uint32_t triangleId,
         const glm::vec3 &rayFrom,
-        const glm::vec3 &rayDir
+        const glm::vec3 &rayDir,
+        float tMin,
+        float tMax
 ) {
-    auto q = rayFrom - triangle.p;
-    auto det = glm::dot(rayDir, glm::cross(triangle.e2, triangle.e1));
+    const glm::vec3 &e1 = triangles.edges1[triangleId];
+    const glm::vec3 &e2 = triangles.edges2[triangleId];
+    const glm::vec3 &e1e2 = triangles.crosses[triangleId];
+    auto q = rayFrom - triangles.points[triangleId];
+    auto det = -glm::dot(rayDir, e1e2);
 
     if (fabsf(det) < EPS) {
         return TriangleHit(false);
     }
 
-    auto dett = glm::dot(q, glm::cross(triangle.e1, triangle.e2));
+    auto dett = glm::dot(q, e1e2);
     auto t = dett / det;
-    if (t < EPS) {
+    if (t < tMin || t >= tMax) {
         return TriangleHit(false);
     }
 
-    auto detu = glm::dot(rayDir, glm::cross(triangle.e2, q));
-    auto detv = glm::dot(rayDir, glm::cross(q, triangle.e1));
+    /* dot(rayDir, cross(e2, q)) and dot(rayDir, cross(q, e1)) rewritten around one cross product */
+    auto qd = glm::cross(q, rayDir);
+    auto detu = glm::dot(e2, qd);
+    auto detv = -glm::dot(e1, qd);
     auto u = detu / det;
     auto v = detv / det;
     if (u < 0.0 || v < 0.0 || v + u > 1.0) {
         return TriangleHit(false);
     }
 
-    auto hitPt = rayFrom + t * rayDir;
-    return TriangleHit(true, t, u, v, hitPt, triangle.norm);
+    return TriangleHit(true, t, u, v);
 }
 
 
 SphereHit
 computeSphereHit(
-        const Sphere &sphere,
+        const SphereArrays &spheres,
+        uint32_t sphereId,
         const glm::vec3 &rayFrom,
-        const glm::vec3 &rayDir
+        const glm::vec3 &rayDir,
+        float tMin,
+        float tMax
 ) {
-    glm::vec3 v = rayFrom - sphere.center;
+    const glm::vec3 &center = spheres.centers[sphereId];
+    float radius = spheres.radii[sphereId];
+    glm::vec3 v = rayFrom - center;
     float a = glm::dot(rayDir, rayDir);
     float b = 2 * glm::dot(v, rayDir);
-    float c = glm::dot(v, v) - sphere.radius * sphere.radius;
+    float c = glm::dot(v, v) - radius * radius;
     float d = b * b - 4 * a * c;
     if (d < 0) {
         return SphereHit(false);
     } else if (fabsf(d) < EPS) {
         float t = -b / 2 * a;
-        if (t > EPS) {
-            glm::vec3 hitPt = rayFrom + t * rayDir;
-            return SphereHit(true, t, hitPt, (hitPt - sphere.center) / sphere.radius);
+        if (t > tMin && t < tMax) {
+            return SphereHit(true, t);
         } else {
             return SphereHit(false);
         }
@@ -354,18 +815,15 @@ computeSphereHit(
         float sqrtD = sqrtf(d);
         float t1 = (-b + sqrtD) / (2 * a);
         float t2 = (-b - sqrtD) / (2 * a);
-        if (t1 > EPS && t2 > EPS) {
-            float t = t1 < t2 ? t1 : t2;
-            glm::vec3 hitPt = rayFrom + t * rayDir;
-            return SphereHit(true, t, hitPt, (hitPt - sphere.center) / sphere.radius);
-        } else if (t1 > EPS) {
-            float t = t1;
-            glm::vec3 hitPt = rayFrom + t * rayDir;
-            return SphereHit(true, t, hitPt, (hitPt - sphere.center) / sphere.radius);
-        } else if (t2 > EPS) {
-            float t = t2;
-            glm::vec3 hitPt = rayFrom + t * rayDir;
-            return SphereHit(true, t, hitPt, (hitPt - sphere.center) / sphere.radius);
+        /* the nearer root may lie before tMin while the farther one is still on the segment */
+        bool t1Valid = t1 > tMin && t1 < tMax;
+        bool t2Valid = t2 > tMin && t2 < tMax;
+        if (t1Valid && t2Valid) {
+            return SphereHit(true, t1 < t2 ? t1 : t2);
+        } else if (t1Valid) {
+            return SphereHit(true, t1);
+        } else if (t2Valid) {
+            return SphereHit(true, t2);
         } else {
             return SphereHit(false);
         }
@@ -373,6 +831,33 @@ computeSphereHit(
 }
 
 
+bool
+isLampBehindSurface(
+        const glm::vec3 &toLamp,
+        const glm::vec3 &norm,
+        const glm::vec3 &rayDir
+) {
+    float dotWithLamp = glm::dot(toLamp, norm);
+    float dotWithDir = glm::dot(rayDir, norm);
+    return (dotWithDir < 0.0 && dotWithLamp < 0.0) || (dotWithDir > 0.0 && dotWithLamp > 0.0);
+}
+
+
+glm::vec3
+computeLampLight(
+        const Material &material,
+        const Hit &hit,
+        const Lamp &lamp,
+        const glm::vec3 &toLamp,
+        const glm::vec3 &rayDir
+) {
+    glm::vec3 retColor = hit.color * material.diffusiveFactor * computeDiffusiveLight(lamp, toLamp, hit.norm);
+    retColor += hit.color * material.specularFactor *
+                computePhongLight(lamp, toLamp, hit.norm, rayDir, material.specularHardness);
+    return retColor;
+}
+
+
 float
 computeDiffusiveLight(
         const Lamp &lamp,
@@ -408,28 +893,60 @@ computeAmbientOcclusion(
         const Scene &scene,
         const glm::vec3 &pt,
         const glm::vec3 &norm,
-        const glm::vec3 &rayDir
+        const glm::vec3 &rayDir,
+        uint32_t depth,
+        uint32_t rngKey
 ) {
+    glm::vec3 realNorm = glm::dot(rayDir, norm) < 0.0f ? norm : -norm;
+#ifdef ENABLE_AO_CACHE
+    float cached;
+    if (scene.aoCache && scene.aoCache->lookup(pt, realNorm, cached)) {
+        return cached;
+    }
+    /* sum of 1 / distance over the occluded rays, gives the validity radius of the new record */
+    float invDistSum = 0.0f;
+#endif
+
     float retVal = 0.0f;
     for (int i = 0; i < AO_RAYS_COUNT; i++) {
-        glm::vec3 realNorm = glm::dot(rayDir, norm) < 0.0f ? norm : -norm;
-        glm::vec3 randomRay = generateRandomRayInHalfSphere(realNorm);
-
+        uint32_t counter = (depth * AO_RAYS_COUNT + i) * 3;
+        glm::vec3 randomRay = generateRandomRayInHalfSphere(realNorm, rngKey, counter);
+
+#ifdef ENABLE_AO_CACHE
+        Hit occluder = computeClosestHit(scene, pt, randomRay);
+        bool inShade = occluder.isHit;
+        if (inShade) {
+            invDistSum += 1.0f / std::max(occluder.t * glm::length(randomRay), (float) EPS);
+        }
+#else
         bool inShade = computeAnyHit(scene, pt, randomRay);
+#endif
 
         if (!inShade) {
             retVal += scene.worldAmbientFactor;
         }
     }
-    return retVal / static_cast<float>(AO_RAYS_COUNT);
+    float occlusion = retVal / static_cast<float>(AO_RAYS_COUNT);
+
+#ifdef ENABLE_AO_CACHE
+    if (scene.aoCache) {
+        float radius = invDistSum > 0.0f ? static_cast<float>(AO_RAYS_COUNT) / invDistSum : INFINITY;
+        scene.aoCache->insert(pt, realNorm, occlusion, radius);
+    }
+#endif
+    return occlusion;
 }
 
 
-glm::vec3 generateRandomRayInHalfSphere(const glm::vec3 &norm) {
-    glm::vec3 randomRay;
-    float randX = fabsf(2.0f * static_cast<float>(rand()) / static_cast<float>(RAND_MAX)) - 1.0f;
-    float randY = fabsf(2.0f * static_cast<float>(rand()) / static_cast<float>(RAND_MAX)) - 1.0f;
-    float randZ = fabsf(2.0f * static_cast<float>(rand()) / static_cast<float>(RAND_MAX)) - 1.0f;
-    randomRay = glm::vec3(randX, randY, randZ);
+glm::vec3
+generateRandomRayInHalfSphere(
+        const glm::vec3 &norm,
+        uint32_t rngKey,
+        uint32_t counter
+) {
+    float randX = 2.0f * randomFloat(rngKey, counter) - 1.0f;
+    float randY = 2.0f * randomFloat(rngKey, counter + 1) - 1.0f;
+    float randZ = 2.0f * randomFloat(rngKey, counter + 2) - 1.0f;
+    glm::vec3 randomRay(randX, randY, randZ);
     return glm::dot(randomRay, norm) < EPS ? -randomRay : randomRay;
 }
@@ -7,6 +7,9 @@
 
 #include "image_bitmap.h"
 #include "scene.h"
+#include "mpsc_queue.h"
+#include "thread_pool.h"
+#include "counter_rng.h"
 
 
 void
@@ -16,51 +19,171 @@ renderScene(
 );
 
 
+/**
+  Renders the part of a fullWidth x fullHeight frame covered by outTile
+*/
 void
 renderScene(
-        image_bitmap &outImg,
+        image_tile &outTile,
         const Scene &scene,
         int fullWidth,
-        int fullHeight,
-        int x,
-        int y
+        int fullHeight
+);
+
+
+/**
+  {x, y, width, height} of the SUB_BLOCK_WIDTH x SUB_BLOCK_HEIGHT blocks covering the frame
+*/
+std::vector<std::tuple<int, int, int, int>>
+splitSubBlocks(
+        int width,
+        int height
 );
 
 
-std::shared_ptr<bool>
+/**
+  Queues the sub-blocks of the frame on the pool. Workers render straight into outImg and push the
+  {x, y, width, height} of every finished block to outQueue. Until the future is ready only popped blocks
+  of outImg may be read, the rest is being written.
+  The returned future becomes ready when the last block has been pushed
+*/
+std::shared_future<void>
 renderParallel(
+        thread_pool &pool,
         std::shared_ptr<Scene> scene,
-        std::shared_ptr<synchronized_queue<std::tuple<int, int, std::shared_ptr<image_bitmap>>>> outQueue,
+        std::shared_ptr<image_bitmap> outImg,
+        std::shared_ptr<mpsc_queue<std::tuple<int, int, int, int>>> outQueue,
         int width,
         int height
 );
 
 
-void taskProcessor(
+void
+renderSubBlock(
+        const Scene &scene,
+        image_tile outTile,
+        mpsc_queue<std::tuple<int, int, int, int>> &outQueue,
+        int fullWidth,
+        int fullHeight
+);
+
+
+/**
+  Adds one jittered sample per pixel to accumImg, which holds the linear color sums of passes 0 .. passIdx,
+  and writes their average to outImg. Pass 0 overwrites the sums, so restarting after a camera move
+  needs no clear. The scene must not change until the returned future is ready
+*/
+std::shared_future<void>
+renderProgressivePass(
+        thread_pool &pool,
         std::shared_ptr<Scene> scene,
-        std::shared_ptr<bool> finishedFlag,
-        std::shared_ptr<synchronized_queue<std::tuple<int, int, std::shared_ptr<image_bitmap>>>> outQueue,
-        std::shared_ptr<std::vector<std::tuple<int, int, int, int>>> inQueue,
-        std::shared_ptr<std::mutex> inQueueMutex,
+        std::shared_ptr<image_bitmap> accumImg,
+        std::shared_ptr<image_bitmap> outImg,
+        uint32_t passIdx,
+        int width,
+        int height
+);
+
+
+void
+renderProgressiveBlock(
+        const Scene &scene,
+        image_tile accumTile,
+        image_tile outTile,
+        uint32_t passIdx,
         int fullWidth,
         int fullHeight
 );
 
 
+/**
+  Direction of the camera ray through the point (px, py) of a fullWidth x fullHeight frame, in pixels
+*/
+glm::vec3
+cameraRayDir(
+        const Scene &scene,
+        int fullWidth,
+        int fullHeight,
+        float px,
+        float py
+);
+
+
+/**
+  Offset of AA sample sampleIdx inside its pixel. The AA_MAX_SAMPLES samples lie on a regular grid,
+  sample 0 is the pixel corner
+*/
+glm::vec2
+pixelSampleOffset(
+        int sampleIdx
+);
+
+
+/**
+  Traces up to PACKET_SIZE camera rays, as one packet with ENABLE_RAY_PACKETS.
+  outHits, if not null, receives the first hit of every ray
+*/
+void
+tracePrimaryRays(
+        const Scene &scene,
+        const glm::vec3 *rayDirs,
+        const uint32_t *rngKeys,
+        int rayCount,
+        glm::vec3 *outColors,
+        Hit *outHits
+);
+
+
+/**
+  True if two neighbouring camera samples see different primitives, materials, normals or colors,
+  so the pixels between them need more AA samples
+*/
+bool
+isAaEdge(
+        const Hit &hitA,
+        const glm::vec3 &colorA,
+        const Hit &hitB,
+        const glm::vec3 &colorB
+);
+
+
+/**
+  rngKey selects the random stream of the sample, see randomKey.
+  outHit, if not null, receives the closest hit of the ray itself
+*/
 glm::vec3
 traceRay(
         const Scene &scene,
         const glm::vec3 &rayFrom,
         const glm::vec3 &rayDir,
-        uint32_t depth
+        uint32_t depth,
+        uint32_t rngKey,
+        Hit *outHit = nullptr
+);
+
+
+/**
+  Ambient and shadowed lamp light at the hit, the color of traceRay without AO and reflections
+*/
+glm::vec3
+computeDirectColor(
+        const Scene &scene,
+        const Hit &hit,
+        const glm::vec3 &rayDir
 );
 
 
+/**
+  Only hits between tMin and tMax count, t is measured in units of rayDir.
+  A shadow ray with rayDir = lamp - rayFrom and tMax = 1 ignores everything behind the lamp
+*/
 Hit
 computeClosestHit(
         const Scene &scene,
         const glm::vec3 &rayFrom,
-        const glm::vec3 &rayDir
+        const glm::vec3 &rayDir,
+        float tMin = EPS,
+        float tMax = INFINITY
 );
 
 
@@ -68,22 +191,113 @@ bool
 computeAnyHit(
         const Scene &scene,
         const glm::vec3 &rayFrom,
-        const glm::vec3 &rayDir
+        const glm::vec3 &rayDir,
+        float tMin = EPS,
+        float tMax = INFINITY
+);
+
+
+Hit
+computeClosestHitBvh(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        float tMin = EPS,
+        float tMax = INFINITY
+);
+
+
+bool
+computeAnyHitBvh(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        float tMin = EPS,
+        float tMax = INFINITY
+);
+
+
+/**
+  Reference implementations testing every primitive, used to verify the BVH traversal.
+*/
+Hit
+computeClosestHitLinear(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        float tMin = EPS,
+        float tMax = INFINITY
+);
+
+
+bool
+computeAnyHitLinear(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        float tMin = EPS,
+        float tMax = INFINITY
+);
+
+
+/**
+  Shading data of the closer of the two hits, triangleId and sphereId are only read if their hit is set.
+  The point, normal and texture color are only evaluated here, once for the winning primitive
+*/
+Hit
+makeHit(
+        const Scene &scene,
+        const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        const TriangleHit &closestTriangleHit,
+        uint32_t triangleId,
+        const SphereHit &closestSphereHit,
+        uint32_t sphereId
 );
 
 
 TriangleHit
 computeTriangleHit(
-        const Triangle &triangle,
+        const TriangleArrays &triangles,
+        uint32_t triangleId,
         const glm::vec3 &rayFrom,
-        const glm::vec3 &rayDir
+        const glm::vec3 &rayDir,
+        float tMin,
+        float tMax
 );
 
 
 SphereHit
 computeSphereHit(
-        const Sphere &sphere,
+        const SphereArrays &spheres,
+        uint32_t sphereId,
         const glm::vec3 &rayFrom,
+        const glm::vec3 &rayDir,
+        float tMin,
+        float tMax
+);
+
+
+/**
+  True if the lamp and the viewer are on different sides of the surface, so the lamp can't light the hit
+*/
+bool
+isLampBehindSurface(
+        const glm::vec3 &toLamp,
+        const glm::vec3 &norm,
+        const glm::vec3 &rayDir
+);
+
+
+/**
+  Diffuse and specular light of an unshadowed lamp at the hit
+*/
+glm::vec3
+computeLampLight(
+        const Material &material,
+        const Hit &hit,
+        const Lamp &lamp,
+        const glm::vec3 &toLamp,
         const glm::vec3 &rayDir
 );
 
@@ -96,12 +310,18 @@ computeDiffusiveLight(
 );
 
 
+/**
+  Share of AO_RAYS_COUNT random rays that escape, scaled by the world ambient factor.
+  The rays of every reflection depth use their own counters of the rngKey stream
+*/
 float
 computeAmbientOcclusion(
         const Scene &scene,
         const glm::vec3 &pt,
         const glm::vec3 &norm,
-        const glm::vec3 &rayDir
+        const glm::vec3 &rayDir,
+        uint32_t depth,
+        uint32_t rngKey
 );
 
 
@@ -115,8 +335,13 @@ computePhongLight(
 );
 
 
+/**
+  Consumes counters counter .. counter + 2 of the rngKey stream
+*/
 glm::vec3
 generateRandomRayInHalfSphere(
-        const glm::vec3 &norm
+        const glm::vec3 &norm,
+        uint32_t rngKey,
+        uint32_t counter
 );
 #endif //RAY_TRACING_RAY_TRACER_H
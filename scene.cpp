@@ -7,11 +7,12 @@
 #include "scene.h"
 #include "lib/json.h"
 #include "opencl_executor.h"
+#include "bvh.h"
+#include "ao_cache.h"
 
 using Json = nlohmann::json;
 
 
-
 void
 loadScene(
         Scene &outScene,
@@ -35,21 +36,30 @@ loadScene(
     }
 
     for (Json &i : inputJson["materials"]) {
-        std::shared_ptr<Material> material(new Material());
-        material->color = glm::vec3(i["diffusiveColor"][0], i["diffusiveColor"][1], i["diffusiveColor"][2]);
-        material->diffusiveFactor = i["diffusiveFactor"];
-        material->specularFactor = i["specularFactor"];
-        material->specularHardness = i["specularHardness"];
-        material->reflectionFactor = i["reflectionFactor"];
+        Material material;
+        material.color = glm::vec3(i["diffusiveColor"][0], i["diffusiveColor"][1], i["diffusiveColor"][2]);
+        material.diffusiveFactor = i["diffusiveFactor"];
+        material.specularFactor = i["specularFactor"];
+        material.specularHardness = i["specularHardness"];
+        material.reflectionFactor = i["reflectionFactor"];
         if (i["imagePath"] != nullptr) {
-            material->texImage = tex_image::createImage(i["imagePath"]);
-            material->texImage->setScaleX(i["scaleX"]);
-            material->texImage->setScaleY(i["scaleY"]);
-            material->textured = true;
+            material.texImage = tex_image::createImage(i["imagePath"]);
+            material.texImage->setScaleX(i["scaleX"]);
+            material.texImage->setScaleY(i["scaleY"]);
+            material.textured = true;
         }
         outScene.materials.push_back(material);
     }
 
+    /* primitives without a material share one default material, appended on first use */
+    const uint32_t defaultMaterialId = (uint32_t) outScene.materials.size();
+    auto useDefaultMaterial = [&outScene, defaultMaterialId]() -> uint32_t {
+        if (outScene.materials.size() == defaultMaterialId) {
+            outScene.materials.push_back(Material());
+        }
+        return defaultMaterialId;
+    };
+
     std::vector<glm::vec3> vertices;
     for (Json &i : inputJson["vertices"]) {
         float x = i[0];
@@ -73,24 +83,22 @@ loadScene(
             uvV[0] = float(i["uv"][2][0]) - uvStart[0];
             uvV[1] = float(i["uv"][2][1]) - uvStart[1];
         }
-        std::shared_ptr<Material> material;
+        uint32_t materialId;
         if (i["material"] != nullptr) {
-            material = outScene.materials[i["material"]];
-            if (material->texImage.get() != nullptr) {
-                uvStart[0] *= (material->texImage->getWidth() * material->texImage->getScaleX());
-                uvStart[1] *= (material->texImage->getHeight() * material->texImage->getScaleY());
-                uvU[0] *= (material->texImage->getWidth() * material->texImage->getScaleX());
-                uvU[1] *= (material->texImage->getHeight() * material->texImage->getScaleY());
-                uvV[0] *= (material->texImage->getWidth() * material->texImage->getScaleX());
-                uvV[1] *= (material->texImage->getHeight() * material->texImage->getScaleY());
+            materialId = i["material"].get<uint32_t>();
+            const std::shared_ptr<tex_image> &texImage = outScene.materials[materialId].texImage;
+            if (texImage.get() != nullptr) {
+                uvStart[0] *= (texImage->getWidth() * texImage->getScaleX());
+                uvStart[1] *= (texImage->getHeight() * texImage->getScaleY());
+                uvU[0] *= (texImage->getWidth() * texImage->getScaleX());
+                uvU[1] *= (texImage->getHeight() * texImage->getScaleY());
+                uvV[0] *= (texImage->getWidth() * texImage->getScaleX());
+                uvV[1] *= (texImage->getHeight() * texImage->getScaleY());
             }
         } else {
-            material.reset(new Material());
+            materialId = useDefaultMaterial();
         }
-        std::shared_ptr<Triangle> triangle(
-                new Triangle(p, e1, e2, uvStart, uvU, uvV, glm::normalize(glm::cross(e1, e2)), material)
-        );
-        outScene.triangles.push_back(triangle);
+        outScene.triangles.push_back(p, e1, e2, uvStart, uvU, uvV, glm::normalize(glm::cross(e1, e2)), materialId);
     }
 
     for (Json &i : inputJson["spheres"]) {
@@ -98,14 +106,13 @@ loadScene(
         int y = i["center"][1];
         int z = i["center"][2];
         float radius = i["radius"];
-        std::shared_ptr<Material> material;
+        uint32_t materialId;
         if (i["material"] != nullptr) {
-            material = outScene.materials[i["material"]];
+            materialId = i["material"].get<uint32_t>();
         } else {
-            material.reset(new Material());
+            materialId = useDefaultMaterial();
         }
-        std::shared_ptr<Sphere> sphere(new Sphere(glm::vec3(x, y, z), radius, material));
-        outScene.spheres.push_back(sphere);
+        outScene.spheres.push_back(glm::vec3(x, y, z), radius, materialId);
     }
 
     for (Json &i : inputJson["lamps"]) {
@@ -132,4 +139,10 @@ loadScene(
     );
     outScene.camPos = pos;
     outScene.camMat = mat;
+
+    buildBvh(outScene);
+#ifdef ENABLE_AO_CACHE
+    outScene.aoCache.reset(new ao_cache(AO_CACHE_MAX_ERROR, AO_CACHE_MIN_RADIUS, AO_CACHE_MAX_RADIUS,
+                                        AO_CACHE_LOCK_STRIPES));
+#endif
 }
@@ -8,15 +8,18 @@
 #include "config.h"
 
 #include <glm/glm.hpp>
+#include <cmath>
+#include <cstdint>
 #include <vector>
 #include <memory>
+#include <type_traits>
 #include <iostream>
 #include "lib/lodepng.h"
 #include "image_bitmap.h"
 #include "tex_image.h"
-#include "synchronized_queue.h"
 
 class OpenClExecutor;
+class ao_cache;
 
 typedef struct _Material {
     glm::vec3 color;
@@ -45,42 +48,47 @@ typedef struct _Material {
 } Material;
 
 
+/**
+  Closest hit of a ray, materialId indexes Scene::materials, primId follows Scene::bvhPrimIds numbering.
+  Plain data, so copying hits never touches shared reference counts
+*/
 typedef struct _Hit {
-    std::shared_ptr<Material> mtl;
+    uint32_t materialId;
+    uint32_t primId;
     glm::vec3 point;
     glm::vec3 norm;
     glm::vec3 color;
     float t;
     bool isHit;
 
-    _Hit(bool isHit,
-         const std::shared_ptr<Material> &mtl = std::shared_ptr<Material>(),
+    _Hit(bool isHit = false,
+         uint32_t materialId = 0,
          const glm::vec3 &point = glm::vec3(),
          const glm::vec3 &norm = glm::vec3(),
          const glm::vec3 &color = glm::vec3(),
-         float t = 0.0f
-    ) : mtl(mtl), point(point), norm(norm), color(color), t(t), isHit(isHit) {}
+         float t = 0.0f,
+         uint32_t primId = 0
+    ) : materialId(materialId), primId(primId), point(point), norm(norm), color(color), t(t), isHit(isHit) {}
 } Hit;
 
+static_assert(std::is_trivially_copyable<Hit>::value, "Hit must stay plain data");
 
+
+/**
+  Intersection candidates only carry what traversal compares, makeHit derives the point and normal of the winner
+*/
 typedef struct _SphereHit {
-    glm::vec3 point;
-    glm::vec3 norm;
     float t;
     bool isHit;
 
     _SphereHit(
             bool isHit,
-            float t = 0.0f,
-            const glm::vec3 &point = glm::vec3(),
-            const glm::vec3 &norm = glm::vec3()
-    ) : point(point), norm(norm), t(t), isHit(isHit) {}
+            float t = 0.0f
+    ) : t(t), isHit(isHit) {}
 } SphereHit;
 
 
 typedef struct _TriangleHit {
-    glm::vec3 point;
-    glm::vec3 norm;
     float t;
     float u;
     float v;
@@ -90,24 +98,37 @@ typedef struct _TriangleHit {
             bool isHit,
             float t = 0.0f,
             float u = 0.0f,
-            float v = 0.0f,
-            const glm::vec3 &point = glm::vec3(),
-            const glm::vec3 &norm = glm::vec3()
-    ) : point(point), norm(norm), t(t), u(u), v(v), isHit(isHit) {}
+            float v = 0.0f
+    ) : t(t), u(u), v(v), isHit(isHit) {}
 } TriangleHit;
 
 
-typedef struct _Triangle {
-    glm::vec3 p;
-    glm::vec3 e1;
-    glm::vec3 e2;
-    glm::vec2 uvStart;
-    glm::vec2 uvU;
-    glm::vec2 uvV;
-    glm::vec3 norm;
-    std::shared_ptr<Material> material;
-
-    _Triangle(
+/**
+  Triangles as a structure of arrays, index i of every array describes triangle i.
+  The intersection test only reads points, edges1, edges2 and crosses, shading data lives in the other arrays.
+*/
+typedef struct _TriangleArrays {
+    std::vector<glm::vec3> points;
+    std::vector<glm::vec3> edges1;
+    std::vector<glm::vec3> edges2;
+    /* cross(e1, e2), not normalized, precomputed so that the intersection test needs a single cross product */
+    std::vector<glm::vec3> crosses;
+    std::vector<glm::vec3> norms;
+    std::vector<glm::vec2> uvStarts;
+    std::vector<glm::vec2> uvUs;
+    std::vector<glm::vec2> uvVs;
+    /* indices into Scene::materials */
+    std::vector<uint32_t> materialIds;
+
+    inline size_t size() const {
+        return points.size();
+    }
+
+    inline bool empty() const {
+        return points.empty();
+    }
+
+    void push_back(
             const glm::vec3 &p,
             const glm::vec3 &e1,
             const glm::vec3 &e2,
@@ -115,20 +136,48 @@ typedef struct _Triangle {
             const glm::vec2 &uvU,
             const glm::vec2 &uvV,
             const glm::vec3 &norm,
-            const std::shared_ptr<Material> &material)
-            : p(p), e1(e1), e2(e2), uvStart(uvStart), uvU(uvU), uvV(uvV), norm(norm), material(material) {}
-} Triangle;
-
-
-typedef struct _Sphere {
-    glm::vec3 center;
-    float radius;
-    std::shared_ptr<Material> material;
-
-    _Sphere(const glm::vec3 &center, float radius, const std::shared_ptr<Material> &material) : center(center),
-                                                                                                radius(radius),
-                                                                                                material(material) {}
-} Sphere;
+            uint32_t materialId
+    ) {
+        points.push_back(p);
+        edges1.push_back(e1);
+        edges2.push_back(e2);
+        crosses.push_back(glm::cross(e1, e2));
+        norms.push_back(norm);
+        uvStarts.push_back(uvStart);
+        uvUs.push_back(uvU);
+        uvVs.push_back(uvV);
+        materialIds.push_back(materialId);
+    }
+} TriangleArrays;
+
+
+/**
+  Spheres as a structure of arrays, see TriangleArrays
+*/
+typedef struct _SphereArrays {
+    std::vector<glm::vec3> centers;
+    std::vector<float> radii;
+    /* indices into Scene::materials */
+    std::vector<uint32_t> materialIds;
+
+    inline size_t size() const {
+        return centers.size();
+    }
+
+    inline bool empty() const {
+        return centers.empty();
+    }
+
+    void push_back(
+            const glm::vec3 &center,
+            float radius,
+            uint32_t materialId
+    ) {
+        centers.push_back(center);
+        radii.push_back(radius);
+        materialIds.push_back(materialId);
+    }
+} SphereArrays;
 
 
 typedef struct _Lamp {
@@ -140,34 +189,67 @@ typedef struct _Lamp {
 } Lamp;
 
 
+/**
+  Node of the flattened bounding volume hierarchy.
+  Inner node: leftFirst is the index of the left child, the right child follows it.
+  Leaf: leftFirst is the first index into Scene::bvhPrimIds, primCount > 0.
+*/
+typedef struct _BvhNode {
+    glm::vec3 bboxMin;
+    uint32_t leftFirst;
+    glm::vec3 bboxMax;
+    uint32_t primCount;
+
+    _BvhNode() : bboxMin(), leftFirst(0), bboxMax(), primCount(0) {}
+} BvhNode;
+
+
 typedef struct _Scene {
-    std::vector<std::shared_ptr<Material>> materials;
-    std::vector<std::shared_ptr<Triangle>> triangles;
-    std::vector<std::shared_ptr<Sphere>> spheres;
+    std::vector<Material> materials;
+    TriangleArrays triangles;
+    SphereArrays spheres;
     std::vector<std::shared_ptr<Lamp>> lamps;
+    std::vector<BvhNode> bvhNodes;
+    /* ids < triangles.size() are triangles, the rest are spheres shifted by triangles.size() */
+    std::vector<uint32_t> bvhPrimIds;
     glm::vec3 camPos;
     glm::mat3 camMat;
     glm::vec3 worldHorizonColor;
     glm::vec3 worldAmbientColor;
     float worldAmbientFactor;
+    /* null unless ENABLE_AO_CACHE, filled while rendering and kept between frames */
+    std::shared_ptr<ao_cache> aoCache;
 } Scene;
 
 
+/**
+  Ray in the OpenCL layout, two float4: the origin with tMin and the direction with tMax.
+  Only hits with tMin < t < tMax count
+*/
 typedef struct _RayData {
     float p_x;
     float p_y;
     float p_z;
+    float tMin;
     float d_x;
     float d_y;
     float d_z;
+    float tMax;
+
+    _RayData()
+            : p_x(0.0f), p_y(0.0f), p_z(0.0f), tMin(RAY_T_MIN)
+            , d_x(0.0f), d_y(0.0f), d_z(0.0f), tMax(INFINITY) {}
 
     _RayData(
             float p_x, float p_y, float p_z,
-            float d_x, float d_y, float d_z)
-            : p_x(p_x), p_y(p_y), p_z(p_z)
-            , d_x(d_x), d_y(d_y), d_z(d_z) {}
+            float d_x, float d_y, float d_z,
+            float tMin = RAY_T_MIN, float tMax = INFINITY)
+            : p_x(p_x), p_y(p_y), p_z(p_z), tMin(tMin)
+            , d_x(d_x), d_y(d_y), d_z(d_z), tMax(tMax) {}
 } RayData;
 
+static_assert(sizeof(RayData) == 8 * sizeof(float), "RayData must match the ray layout of the kernels");
+
 
 void
 loadScene(
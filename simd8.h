@@ -0,0 +1,211 @@
+#ifndef RAY_TRACING_SIMD8_H
+#define RAY_TRACING_SIMD8_H
+
+#include <cmath>
+#include <cstdint>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/**
+  8-wide float vector and lane mask for the packet tracer. With AVX2 enabled they map to __m256,
+  otherwise to plain arrays with the same per-lane results, so the packet code builds and runs everywhere.
+*/
+
+#ifdef __AVX2__
+
+typedef struct _simd8b {
+    __m256 v;
+
+    _simd8b() : v(_mm256_setzero_ps()) {}
+
+    explicit _simd8b(__m256 v) : v(v) {}
+
+    /* lane i is set when bit i of bits is set */
+    static _simd8b fromBits(int bits) {
+        __m256i lanes = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+        __m256i set = _mm256_and_si256(_mm256_set1_epi32(bits), lanes);
+        return _simd8b(_mm256_castsi256_ps(_mm256_cmpeq_epi32(set, lanes)));
+    }
+
+    int bits() const {
+        return _mm256_movemask_ps(v);
+    }
+} simd8b;
+
+
+typedef struct _simd8f {
+    __m256 v;
+
+    _simd8f() : v(_mm256_setzero_ps()) {}
+
+    explicit _simd8f(__m256 v) : v(v) {}
+
+    _simd8f(float x) : v(_mm256_set1_ps(x)) {}
+
+    static _simd8f load(const float *data) {
+        return _simd8f(_mm256_loadu_ps(data));
+    }
+
+    void store(float *data) const {
+        _mm256_storeu_ps(data, v);
+    }
+} simd8f;
+
+
+inline simd8f operator+(const simd8f &a, const simd8f &b) { return simd8f(_mm256_add_ps(a.v, b.v)); }
+
+inline simd8f operator-(const simd8f &a, const simd8f &b) { return simd8f(_mm256_sub_ps(a.v, b.v)); }
+
+inline simd8f operator*(const simd8f &a, const simd8f &b) { return simd8f(_mm256_mul_ps(a.v, b.v)); }
+
+inline simd8f operator/(const simd8f &a, const simd8f &b) { return simd8f(_mm256_div_ps(a.v, b.v)); }
+
+inline simd8f operator-(const simd8f &a) { return simd8f(_mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f))); }
+
+inline simd8f min(const simd8f &a, const simd8f &b) { return simd8f(_mm256_min_ps(a.v, b.v)); }
+
+inline simd8f max(const simd8f &a, const simd8f &b) { return simd8f(_mm256_max_ps(a.v, b.v)); }
+
+inline simd8f sqrt(const simd8f &a) { return simd8f(_mm256_sqrt_ps(a.v)); }
+
+inline simd8f abs(const simd8f &a) { return simd8f(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)); }
+
+inline simd8b operator<(const simd8f &a, const simd8f &b) { return simd8b(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+
+inline simd8b operator>(const simd8f &a, const simd8f &b) { return simd8b(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)); }
+
+inline simd8b operator<=(const simd8f &a, const simd8f &b) { return simd8b(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+
+inline simd8b operator>=(const simd8f &a, const simd8f &b) { return simd8b(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+
+inline simd8b operator&(const simd8b &a, const simd8b &b) { return simd8b(_mm256_and_ps(a.v, b.v)); }
+
+inline simd8b operator|(const simd8b &a, const simd8b &b) { return simd8b(_mm256_or_ps(a.v, b.v)); }
+
+/* a and not b */
+inline simd8b andNot(const simd8b &a, const simd8b &b) { return simd8b(_mm256_andnot_ps(b.v, a.v)); }
+
+/* lanes of a where mask is set, lanes of b elsewhere */
+inline simd8f select(const simd8b &mask, const simd8f &a, const simd8f &b) {
+    return simd8f(_mm256_blendv_ps(b.v, a.v, mask.v));
+}
+
+#else
+
+typedef struct _simd8b {
+    int mask;
+
+    _simd8b() : mask(0) {}
+
+    static _simd8b fromBits(int bits) {
+        _simd8b result;
+        result.mask = bits & 0xff;
+        return result;
+    }
+
+    int bits() const {
+        return mask;
+    }
+} simd8b;
+
+
+typedef struct _simd8f {
+    float v[8];
+
+    _simd8f() : v() {}
+
+    _simd8f(float x) {
+        for (int i = 0; i < 8; i++) {
+            v[i] = x;
+        }
+    }
+
+    static _simd8f load(const float *data) {
+        _simd8f result;
+        for (int i = 0; i < 8; i++) {
+            result.v[i] = data[i];
+        }
+        return result;
+    }
+
+    void store(float *data) const {
+        for (int i = 0; i < 8; i++) {
+            data[i] = v[i];
+        }
+    }
+} simd8f;
+
+
+#define SIMD8_LANEWISE(expr) \
+    simd8f result; \
+    for (int i = 0; i < 8; i++) { \
+        result.v[i] = (expr); \
+    } \
+    return result;
+
+#define SIMD8_COMPARE(expr) \
+    simd8b result; \
+    for (int i = 0; i < 8; i++) { \
+        result.mask |= (expr) ? (1 << i) : 0; \
+    } \
+    return result;
+
+inline simd8f operator+(const simd8f &a, const simd8f &b) { SIMD8_LANEWISE(a.v[i] + b.v[i]) }
+
+inline simd8f operator-(const simd8f &a, const simd8f &b) { SIMD8_LANEWISE(a.v[i] - b.v[i]) }
+
+inline simd8f operator*(const simd8f &a, const simd8f &b) { SIMD8_LANEWISE(a.v[i] * b.v[i]) }
+
+inline simd8f operator/(const simd8f &a, const simd8f &b) { SIMD8_LANEWISE(a.v[i] / b.v[i]) }
+
+inline simd8f operator-(const simd8f &a) { SIMD8_LANEWISE(-a.v[i]) }
+
+/* same NaN handling as minps/maxps: the second operand wins */
+inline simd8f min(const simd8f &a, const simd8f &b) { SIMD8_LANEWISE(a.v[i] < b.v[i] ? a.v[i] : b.v[i]) }
+
+inline simd8f max(const simd8f &a, const simd8f &b) { SIMD8_LANEWISE(a.v[i] > b.v[i] ? a.v[i] : b.v[i]) }
+
+inline simd8f sqrt(const simd8f &a) { SIMD8_LANEWISE(sqrtf(a.v[i])) }
+
+inline simd8f abs(const simd8f &a) { SIMD8_LANEWISE(fabsf(a.v[i])) }
+
+inline simd8b operator<(const simd8f &a, const simd8f &b) { SIMD8_COMPARE(a.v[i] < b.v[i]) }
+
+inline simd8b operator>(const simd8f &a, const simd8f &b) { SIMD8_COMPARE(a.v[i] > b.v[i]) }
+
+inline simd8b operator<=(const simd8f &a, const simd8f &b) { SIMD8_COMPARE(a.v[i] <= b.v[i]) }
+
+inline simd8b operator>=(const simd8f &a, const simd8f &b) { SIMD8_COMPARE(a.v[i] >= b.v[i]) }
+
+#undef SIMD8_LANEWISE
+#undef SIMD8_COMPARE
+
+inline simd8b operator&(const simd8b &a, const simd8b &b) { return simd8b::fromBits(a.mask & b.mask); }
+
+inline simd8b operator|(const simd8b &a, const simd8b &b) { return simd8b::fromBits(a.mask | b.mask); }
+
+inline simd8b andNot(const simd8b &a, const simd8b &b) { return simd8b::fromBits(a.mask & ~b.mask); }
+
+inline simd8f select(const simd8b &mask, const simd8f &a, const simd8f &b) {
+    simd8f result;
+    for (int i = 0; i < 8; i++) {
+        result.v[i] = (mask.mask >> i) & 1 ? a.v[i] : b.v[i];
+    }
+    return result;
+}
+
+#endif
+
+
+inline bool any(const simd8b &mask) {
+    return mask.bits() != 0;
+}
+
+inline bool none(const simd8b &mask) {
+    return mask.bits() == 0;
+}
+
+
+#endif //RAY_TRACING_SIMD8_H
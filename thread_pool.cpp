@@ -0,0 +1,129 @@
+#include "thread_pool.h"
+
+
+typedef struct _TaskBatch {
+    std::atomic<size_t> remaining;
+    std::promise<void> done;
+    std::mutex errorMutex;
+    std::exception_ptr error;
+} TaskBatch;
+
+
+thread_pool::thread_pool(size_t threadCount)
+        : mNextWorker(0), mPendingCount(0), mStopping(false) {
+    if (threadCount == 0) {
+        threadCount = 1;
+    }
+    for (size_t i = 0; i < threadCount; i++) {
+        mWorkers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+    for (size_t i = 0; i < threadCount; i++) {
+        mThreads.push_back(std::thread(&thread_pool::workerLoop, this, i));
+    }
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mSleepMutex);
+        mStopping = true;
+    }
+    mWakeUp.notify_all();
+    for (auto &thread : mThreads) {
+        thread.join();
+    }
+}
+
+std::shared_future<void>
+thread_pool::submitAll(
+        std::vector<std::function<void()>> tasks
+) {
+    std::shared_ptr<TaskBatch> batch(new TaskBatch());
+    batch->remaining = tasks.size();
+    std::shared_future<void> result = batch->done.get_future().share();
+    if (tasks.empty()) {
+        batch->done.set_value();
+        return result;
+    }
+
+    /* raised before the tasks are visible, so a worker never takes a task that isn't counted yet */
+    {
+        std::lock_guard<std::mutex> lock(mSleepMutex);
+        mPendingCount += tasks.size();
+    }
+
+    for (auto &task : tasks) {
+        std::function<void()> body = std::move(task);
+        std::function<void()> wrapped = [batch, body]() {
+            try {
+                body();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(batch->errorMutex);
+                if (!batch->error) {
+                    batch->error = std::current_exception();
+                }
+            }
+            if (--batch->remaining == 0) {
+                if (batch->error) {
+                    batch->done.set_exception(batch->error);
+                } else {
+                    batch->done.set_value();
+                }
+            }
+        };
+
+        Worker &worker = *mWorkers[mNextWorker++ % mWorkers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.push_back(std::move(wrapped));
+    }
+
+    mWakeUp.notify_all();
+    return result;
+}
+
+void
+thread_pool::workerLoop(
+        size_t workerIdx
+) {
+    while (true) {
+        std::function<void()> task;
+        if (takeTask(workerIdx, task)) {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mSleepMutex);
+        mWakeUp.wait(lock, [this]() { return mStopping || mPendingCount > 0; });
+        if (mStopping) {
+            return;
+        }
+    }
+}
+
+bool
+thread_pool::takeTask(
+        size_t workerIdx,
+        std::function<void()> &task
+) {
+    {
+        Worker &own = *mWorkers[workerIdx];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            mPendingCount--;
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < mWorkers.size(); i++) {
+        Worker &victim = *mWorkers[(workerIdx + i) % mWorkers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            mPendingCount--;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,61 @@
+#ifndef RAY_TRACING_THREAD_POOL_H
+#define RAY_TRACING_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+  Persistent pool of worker threads with a deque per worker. A worker takes its newest task first,
+  idle workers steal the oldest task of another worker, so the only shared lock is the one idle workers sleep on.
+*/
+class thread_pool {
+private:
+    typedef struct _Worker {
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+    } Worker;
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    std::vector<std::thread> mThreads;
+    std::atomic<size_t> mNextWorker;
+
+    /* tasks queued but not yet taken, raised under mSleepMutex so sleeping workers can't miss it */
+    std::atomic<size_t> mPendingCount;
+    std::mutex mSleepMutex;
+    std::condition_variable mWakeUp;
+    bool mStopping;
+
+    thread_pool(const thread_pool &pool) = delete;
+
+    thread_pool &operator=(const thread_pool &pool) = delete;
+
+    void workerLoop(size_t workerIdx);
+
+    bool takeTask(size_t workerIdx, std::function<void()> &task);
+
+public:
+    explicit thread_pool(size_t threadCount);
+
+    ~thread_pool();
+
+    size_t getThreadCount() const {
+        return mThreads.size();
+    }
+
+    /**
+      Spreads the tasks over the worker deques. The future becomes ready once every task has finished,
+      it holds the first exception thrown by a task if any
+    */
+    std::shared_future<void> submitAll(std::vector<std::function<void()>> tasks);
+};
+
+
+#endif //RAY_TRACING_THREAD_POOL_H